@@ -0,0 +1,414 @@
+/*
+ * spiflash_bench - end-to-end I/O benchmark for the SPI flash driver (/dev/dfl1)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include "spi_flash_ioctl.h"
+
+#define MAX_BLOCK   (1024*1024)
+#define MAX_THREADS 64
+
+enum { MODE_READ, MODE_WRITE, MODE_MIX };
+
+struct bench_cfg {
+    const char *device;
+    int mode;
+    int random;
+    int readpct;            //reads in percent for MODE_MIX
+    size_t bs;
+    size_t misalign;        //added to every block aligned offset
+    unsigned int threads;
+    unsigned long ops;      //per thread, 0 if time based
+    unsigned int seconds;
+    unsigned long long offset;
+    unsigned long long size;
+    unsigned int seed;
+    int force;              //writes allowed
+    int csv;
+};
+
+struct bench_thread {
+    pthread_t tid;
+    unsigned int id;
+    int fd;
+    unsigned int seed;
+    unsigned long long *lat;    //latency of each op in ns
+    size_t nlat, maxlat;
+    unsigned long long bytes;
+    unsigned long errors;
+};
+
+static struct bench_cfg cfg = {
+    .device   = "/dev/dfl1",
+    .mode     = MODE_READ,
+    .random   = 0,
+    .readpct  = 70,
+    .bs       = 4096,
+    .threads  = 1,
+    .ops      = 0,
+    .seconds  = 5,
+    .seed     = 1,
+};
+
+static unsigned long long seq_cursor;
+static unsigned long long deadline;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long parse_size(const char *s)
+{
+    char *end;
+    unsigned long long v = strtoull(s, &end, 0);
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; break;
+    case 'm': case 'M': v <<= 20; break;
+    case 'g': case 'G': v <<= 30; break;
+    default: break;
+    }
+    return v;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int lat_push(struct bench_thread *t, unsigned long long ns)
+{
+    if (t->nlat == t->maxlat) {
+        size_t n = t->maxlat ? t->maxlat * 2 : 4096;
+        unsigned long long *p = realloc(t->lat, n * sizeof(*p));
+        if (!p)
+            return -1;
+        t->lat = p;
+        t->maxlat = n;
+    }
+    t->lat[t->nlat++] = ns;
+    return 0;
+}
+
+static unsigned long long next_offset(struct bench_thread *t)
+{
+    unsigned long long span = cfg.size - cfg.misalign;
+    unsigned long long blocks = span / cfg.bs, blk;
+    if (cfg.random) {
+        blk = ((unsigned long long)rand_r(&t->seed) << 31 | rand_r(&t->seed)) % blocks;
+    } else {
+        blk = __sync_fetch_and_add(&seq_cursor, 1) % blocks;
+    }
+    return cfg.offset + blk * cfg.bs + cfg.misalign;
+}
+
+static void *bench_worker(void *arg)
+{
+    struct bench_thread *t = arg;
+    unsigned char *buf;
+    unsigned long n;
+    size_t i;
+
+    buf = malloc(cfg.bs);
+    if (!buf) {
+        t->errors++;
+        return NULL;
+    }
+    for (n = 0; cfg.ops ? n < cfg.ops : now_ns() < deadline; n++) {
+        unsigned long long off = next_offset(t), start;
+        int rd = cfg.mode == MODE_READ ||
+            (cfg.mode == MODE_MIX && (int)(rand_r(&t->seed) % 100) < cfg.readpct);
+        ssize_t ret;
+        if (!rd) {
+            //fresh data every time so the driver can't skip the write
+            for (i = 0; i < cfg.bs; i++)
+                buf[i] = (unsigned char)rand_r(&t->seed);
+        }
+        start = now_ns();
+        ret = rd ? pread(t->fd, buf, cfg.bs, off) : pwrite(t->fd, buf, cfg.bs, off);
+        if (ret != (ssize_t)cfg.bs) {
+            t->errors++;
+            continue;
+        }
+        if (lat_push(t, now_ns() - start)) {
+            t->errors++;
+            break;
+        }
+        t->bytes += ret;
+    }
+    free(buf);
+    return NULL;
+}
+
+static int read_stats(int fd, struct spiflash_stats *st)
+{
+    return ioctl(fd, SPIFLASH_IOC_GET_STATS, st);
+}
+
+static const char *mode_name(void)
+{
+    return cfg.mode == MODE_READ ? "read" : cfg.mode == MODE_WRITE ? "write" : "mix";
+}
+
+static int run_bench(void)
+{
+    struct bench_thread *th;
+    struct spiflash_stats st0, st1;
+    unsigned long long t0, t1, bytes = 0, *all, p50, p90, p99, p999, lmax;
+    size_t nall = 0, k;
+    unsigned long errors = 0;
+    unsigned int i;
+    int fd, have_stats, flags = cfg.mode == MODE_READ ? O_RDONLY : O_RDWR;
+    double secs;
+
+    fd = open(cfg.device, flags);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", cfg.device, strerror(errno));
+        return -1;
+    }
+    if (!cfg.size) {
+        struct stat sb;
+        if (read_stats(fd, &st0) == 0)
+            cfg.size = st0.chipsize;
+        else if (fstat(fd, &sb) == 0)
+            cfg.size = sb.st_size;
+        if (cfg.size > cfg.offset)
+            cfg.size -= cfg.offset;
+        else
+            cfg.size = 0;
+    }
+    if (cfg.size < cfg.bs + cfg.misalign) {
+        fprintf(stderr, "region of %llu bytes too small for %zu byte blocks\n", cfg.size, cfg.bs);
+        close(fd);
+        return -1;
+    }
+    have_stats = read_stats(fd, &st0) == 0;
+
+    th = calloc(cfg.threads, sizeof(*th));
+    if (!th) {
+        close(fd);
+        return -1;
+    }
+    seq_cursor = 0;
+    t0 = now_ns();
+    deadline = t0 + (unsigned long long)cfg.seconds * 1000000000ULL;
+    for (i = 0; i < cfg.threads; i++) {
+        th[i].id = i;
+        th[i].seed = cfg.seed + i * 7919;
+        th[i].fd = open(cfg.device, flags);
+        if (th[i].fd < 0 || pthread_create(&th[i].tid, NULL, bench_worker, &th[i])) {
+            fprintf(stderr, "thread %u: %s\n", i, strerror(errno));
+            th[i].errors++;
+            th[i].tid = 0;
+        }
+    }
+    for (i = 0; i < cfg.threads; i++) {
+        if (th[i].tid)
+            pthread_join(th[i].tid, NULL);
+        if (th[i].fd >= 0)
+            close(th[i].fd);
+        nall += th[i].nlat;
+    }
+    t1 = now_ns();
+    if (have_stats)
+        have_stats = read_stats(fd, &st1) == 0;
+    close(fd);
+
+    all = malloc((nall ? nall : 1) * sizeof(*all));
+    for (i = 0, k = 0; i < cfg.threads; i++) {
+        if (all)
+            memcpy(all + k, th[i].lat, th[i].nlat * sizeof(*all));
+        k += th[i].nlat;
+        bytes += th[i].bytes;
+        errors += th[i].errors;
+        free(th[i].lat);
+    }
+    free(th);
+    if (!all)
+        return -1;
+    qsort(all, nall, sizeof(*all), cmp_u64);
+#define PCT(p) (nall ? all[(size_t)((nall - 1) * (p))] : 0)
+    p50 = PCT(0.50);
+    p90 = PCT(0.90);
+    p99 = PCT(0.99);
+    p999 = PCT(0.999);
+    lmax = nall ? all[nall - 1] : 0;
+#undef PCT
+    free(all);
+
+    secs = (t1 - t0) / 1e9;
+    if (cfg.csv) {
+        printf("%s,%s,%zu,%zu,%u,%lu,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%lu",
+            mode_name(), cfg.random ? "rand" : "seq", cfg.bs, cfg.misalign, cfg.threads,
+            (unsigned long)nall, bytes / secs / 1048576.0, nall / secs,
+            p50 / 1e3, p90 / 1e3, p99 / 1e3, p999 / 1e3, lmax / 1e3, errors);
+        if (have_stats)
+            printf(",%llu,%llu,%u,%u", st1.user_bytes - st0.user_bytes,
+                st1.prog_bytes - st0.prog_bytes, st1.prog_pages - st0.prog_pages,
+                st1.erase_sectors - st0.erase_sectors);
+        else
+            printf(",,,,");
+        printf("\n");
+    } else {
+        printf("%s %s bs=%zu misalign=%zu threads=%u: %lu ops in %.2f s, errors %lu\n",
+            mode_name(), cfg.random ? "random" : "sequential", cfg.bs, cfg.misalign,
+            cfg.threads, (unsigned long)nall, secs, errors);
+        printf("  throughput %.3f MB/s, %.1f IOPS\n", bytes / secs / 1048576.0, nall / secs);
+        printf("  latency us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+            p50 / 1e3, p90 / 1e3, p99 / 1e3, p999 / 1e3, lmax / 1e3);
+        if (have_stats) {
+            unsigned long long ub = st1.user_bytes - st0.user_bytes;
+            unsigned long long pb = st1.prog_bytes - st0.prog_bytes;
+            unsigned int er = st1.erase_sectors - st0.erase_sectors;
+            printf("  driver: %llu user bytes, %llu programmed in %u pages, %u erases, %llu read\n",
+                ub, pb, st1.prog_pages - st0.prog_pages, er, st1.read_bytes - st0.read_bytes);
+            if (ub)
+                printf("  amplification: program %.2f, erase %.2f\n", (double)pb / ub,
+                    (double)er * st1.sectorsize / ub);
+        }
+    }
+    return errors ? 1 : 0;
+}
+
+/* the standard run: every row comparable across kernels, boards and driver versions */
+static int run_standard(void)
+{
+    static const struct {
+        int mode, random;
+        size_t bs, misalign;
+        unsigned int threads;
+    } suite[] = {
+        { MODE_READ,  0, 1,           0, 1 },
+        { MODE_READ,  0, 256,         0, 1 },
+        { MODE_READ,  0, 4096,        0, 1 },
+        { MODE_READ,  0, 65536,       0, 1 },
+        { MODE_READ,  0, MAX_BLOCK,   0, 1 },
+        { MODE_READ,  1, 4096,        0, 1 },
+        { MODE_READ,  1, 4096,        1, 1 },
+        { MODE_READ,  1, 4096,        0, 4 },
+        { MODE_WRITE, 0, 256,         0, 1 },
+        { MODE_WRITE, 0, 4096,        0, 1 },
+        { MODE_WRITE, 0, 65536,       0, 1 },
+        { MODE_WRITE, 1, 4096,        0, 1 },
+        { MODE_WRITE, 1, 4096,        100, 1 },
+        { MODE_MIX,   1, 4096,        0, 4 },
+    };
+    struct utsname un;
+    unsigned int i;
+    int ret = 0;
+    struct bench_cfg base = cfg;
+
+    if (uname(&un) == 0)
+        printf("# kernel %s %s, device %s\n", un.release, un.machine, cfg.device);
+    printf("mode,pattern,bs,misalign,threads,ops,MBps,iops,p50_us,p90_us,p99_us,p999_us,max_us,errors,"
+        "user_bytes,prog_bytes,prog_pages,erases\n");
+    cfg.csv = 1;
+    for (i = 0; i < sizeof(suite) / sizeof(suite[0]); i++) {
+        if (suite[i].mode != MODE_READ && !base.force)
+            continue;
+        cfg.mode = suite[i].mode;
+        cfg.random = suite[i].random;
+        cfg.bs = suite[i].bs;
+        cfg.misalign = suite[i].misalign;
+        cfg.threads = suite[i].threads;
+        cfg.size = base.size;
+        if (run_bench())
+            ret = 1;
+        fflush(stdout);
+    }
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -d dev      device (default /dev/dfl1)\n"
+        "  -m mode     read, write or mix (default read)\n"
+        "  -r pct      reads in percent for mix (default 70)\n"
+        "  -p pattern  seq or rand (default seq)\n"
+        "  -b size     block size, 1 to 1M, K/M suffix allowed (default 4K)\n"
+        "  -a bytes    misalign every block by bytes (default 0)\n"
+        "  -j threads  number of threads (default 1)\n"
+        "  -n ops      ops per thread instead of a time limit\n"
+        "  -t secs     run time (default 5)\n"
+        "  -o offset   start of the tested region (default 0)\n"
+        "  -s size     size of the tested region (default whole chip)\n"
+        "  -S seed     random seed (default 1)\n"
+        "  -c          print one csv line\n"
+        "  -x          run the standard suite, csv output\n"
+        "  -y          allow writes, the tested region is destroyed\n",
+        prog);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, standard = 0;
+
+    while ((opt = getopt(argc, argv, "d:m:r:p:b:a:j:n:t:o:s:S:cxyh")) != -1) {
+        switch (opt) {
+        case 'd': cfg.device = optarg; break;
+        case 'm':
+            if (!strcmp(optarg, "read"))
+                cfg.mode = MODE_READ;
+            else if (!strcmp(optarg, "write"))
+                cfg.mode = MODE_WRITE;
+            else if (!strcmp(optarg, "mix"))
+                cfg.mode = MODE_MIX;
+            else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'r': cfg.readpct = atoi(optarg); break;
+        case 'p': cfg.random = !strcmp(optarg, "rand"); break;
+        case 'b': cfg.bs = parse_size(optarg); break;
+        case 'a': cfg.misalign = parse_size(optarg); break;
+        case 'j': cfg.threads = atoi(optarg); break;
+        case 'n': cfg.ops = strtoul(optarg, NULL, 0); break;
+        case 't': cfg.seconds = atoi(optarg); break;
+        case 'o': cfg.offset = parse_size(optarg); break;
+        case 's': cfg.size = parse_size(optarg); break;
+        case 'S': cfg.seed = strtoul(optarg, NULL, 0); break;
+        case 'c': cfg.csv = 1; break;
+        case 'x': standard = 1; break;
+        case 'y': cfg.force = 1; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (cfg.bs < 1 || cfg.bs > MAX_BLOCK || cfg.threads < 1 || cfg.threads > MAX_THREADS ||
+        cfg.readpct < 0 || cfg.readpct > 100) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (standard)
+        return run_standard();
+    if (cfg.mode != MODE_READ && !cfg.force) {
+        fprintf(stderr, "writing destroys the tested region, add -y to confirm\n");
+        return 2;
+    }
+    return run_bench() ? 1 : 0;
+}
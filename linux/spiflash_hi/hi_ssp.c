@@ -42,7 +42,10 @@
 #include <linux/slab.h>
 #include "spi_host.h"
 
-#define SSP_NUMS 1
+#define SSP_NUMS        4   //controllers
+#define SSP_CS_MAX      4   //GPIO chip selects per controller
+#define SSP_FIFO_DEPTH  8
+#define SSP_WIDE_MIN    16  //shorter data isn't worth switching to 16 bit frames
 
 #define ssp_readw(addr,ret)     (ret =(*(volatile unsigned int *)(addr)))
 #define ssp_writew(addr,val)    ((*(volatile unsigned int *)(addr)) = (val))
@@ -52,12 +55,12 @@
 
 #define IO_ADDRESS_VERIFY(x) (hispi->reg_ssp_base_va + ((x)-(SSP_BASE)))
 #define IO_VA(x)             (reg_base_va + (x))
-#define IO_ADDRESS_2(x)      (hispi->reg_gpio_cs_va + (x))
 
 #ifdef HI3520D
 #pragma message("Building SPI flash driver for HI3520DV200")
 
 #define SSP_CPSDVR      2
+#define SSP_CLK_HZ      50000000
 #define SSP_BASE        0x200C0000
 #define SSP_SIZE        0x10000
 
@@ -68,17 +71,14 @@
 #define SPI_SDI         IO_VA(0x38)
 #define SPI_CS0         IO_VA(0x3C)  //GPIO8_3
 
-#define GPIO_CS_BASE    0x201D0000
-#define GPIO_CS_SIZE    0x10000
-/* gpio cs reg */
-#define GPIO_CS         IO_ADDRESS_2(0x20)
-#define GPIO_0_DIR      IO_ADDRESS_2(0x400)
-#define SSP_CS          (1 << 3)
+#define GPIO_BASE       0x20150000   //GPIO0
+#define SSP_CS_GPIO     (8*8 + 3)    //GPIO8_3
 
 #elif defined(HI3521A)
 #pragma message("Building SPI flash driver for HI3520DV300 or HI3521A")
 
 #define SSP_CPSDVR      4
+#define SSP_CLK_HZ      100000000
 #define SSP_BASE        0x120D0000
 #define SSP_SIZE        0x10000
 
@@ -89,17 +89,20 @@
 #define SPI_SDI         IO_VA(0xCC)
 #define SPI_CS0         IO_VA(0xD0)  //GPIO5_3
 
-#define GPIO_CS_BASE    0x121A0000
-#define GPIO_CS_SIZE    0x10000
-/* gpio cs reg */
-#define GPIO_CS         IO_ADDRESS_2(0x20)
-#define GPIO_0_DIR      IO_ADDRESS_2(0x400)
-#define SSP_CS          (1 << 3)
+#define GPIO_BASE       0x12150000   //GPIO0
+#define SSP_CS_GPIO     (5*8 + 3)    //GPIO5_3
 
 #else
 #error "Platform not defined: -DHI3520D or -DHI3521A in makefile"
 #endif
 
+/* gpio groups of 8 pins, one every GPIO_SIZE; gpio numbers are group*8+pin */
+#define GPIO_SIZE               0x10000
+#define GPIO_GROUP_BASE(gpio)   (GPIO_BASE + ((gpio) / 8) * GPIO_SIZE)
+#define GPIO_PIN(gpio)          (1 << ((gpio) % 8))
+#define GPIO_DATA(gpio)         (GPIO_PIN(gpio) << 2)  //address masked, only this pin
+#define GPIO_DIR                0x400
+
 /* SSP register definition .*/
 #define SSP_CR0              IO_ADDRESS_VERIFY(SSP_BASE + 0x00)
 #define SSP_CR1              IO_ADDRESS_VERIFY(SSP_BASE + 0x04)
@@ -117,26 +120,54 @@
 struct hi_spi_host {
     struct spi_hostdev host;    
     void __iomem *reg_ssp_base_va;
-    void __iomem *reg_gpio_cs_va;
+    void __iomem *reg_gpio_cs_va[SSP_CS_MAX];//gpio group of each chip select
+    unsigned int cs_gpio[SSP_CS_MAX];
+    unsigned int reqhz;     //last requested clock
+    unsigned int hz;        //clock really set for reqhz
+    unsigned int width;     //bits per frame set in CR0
 };
 
 static struct hi_spi_host spihosts[SSP_NUMS];
 
+static unsigned int ssp_clk = SSP_CLK_HZ;
+module_param(ssp_clk, uint, S_IRUGO);
+MODULE_PARM_DESC(ssp_clk, "Input clock (in Hz) of the SSP controller");
+
+/*
+ * Controllers and chip selects. Pins of the board's SPI and its first
+ * chip select are muxed by ssp_io_config, any other has to be muxed by
+ * the bootloader.
+ * e.g. ssp_base=0x200C0000 cs_gpio=67,68 cs_ssp=0,0: two flashes on one bus
+ */
+static unsigned int ssp_base[SSP_NUMS] = {SSP_BASE};
+static unsigned int ssp_nums = 1;
+module_param_array(ssp_base, uint, &ssp_nums, S_IRUGO);
+MODULE_PARM_DESC(ssp_base, "Physical address of each SSP controller (default the board's SPI)");
+
+static unsigned int cs_gpio[SSP_NUMS * SSP_CS_MAX] = {SSP_CS_GPIO};
+static unsigned int cs_nums = 1;
+module_param_array(cs_gpio, uint, &cs_nums, S_IRUGO);
+MODULE_PARM_DESC(cs_gpio, "GPIO (group*8+pin) driving each chip select");
+
+static unsigned int cs_ssp[SSP_NUMS * SSP_CS_MAX];
+module_param_array(cs_ssp, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(cs_ssp, "Controller (index into ssp_base) of each chip select (default 0)");
+
 #ifdef SSP_USE_GPIO_DO_CS
-void gpio_cs_init(struct hi_spi_host *hispi)
+void gpio_cs_init(struct hi_spi_host *hispi, unsigned int cs)
 {
     unsigned int reg;    
-    HI_REG_READ(GPIO_0_DIR, reg);
-    reg |= SSP_CS; // output
-    HI_REG_WRITE(GPIO_0_DIR, reg);    
+    HI_REG_READ(hispi->reg_gpio_cs_va[cs] + GPIO_DIR, reg);
+    reg |= GPIO_PIN(hispi->cs_gpio[cs]); // output
+    HI_REG_WRITE(hispi->reg_gpio_cs_va[cs] + GPIO_DIR, reg);    
 }
 
-void gpio_cs_level(struct hi_spi_host *hispi, int high)
+void gpio_cs_level(struct hi_spi_host *hispi, unsigned int cs, int high)
 {
     unsigned int reg = 0;
     if (high)
-        reg = SSP_CS;
-    HI_REG_WRITE(GPIO_CS, reg);     
+        reg = GPIO_PIN(hispi->cs_gpio[cs]);
+    HI_REG_WRITE(hispi->reg_gpio_cs_va[cs] + GPIO_DATA(hispi->cs_gpio[cs]), reg);     
 }
 #endif
 
@@ -175,7 +206,8 @@ static void inline hi_ssp_cs(struct hi_spi_host *hispi, int high)
         ret = ret | (0x01 << 1);
     ssp_writew(SSP_CR1,ret);
  #ifdef SSP_USE_GPIO_DO_CS
-    gpio_cs_level(hispi, high);
+    if (hispi->host.cs < hispi->host.csnums)
+        gpio_cs_level(hispi, hispi->host.cs, high);
  #endif
 }
 
@@ -228,6 +260,7 @@ static int hi_ssp_set_frameform(struct hi_spi_host *hispi, unsigned char framemo
     }
     ret = (ret & 0xFFF0) | (datawidth -1);
     ssp_writew(SSP_CR0,ret);
+    hispi->width = datawidth;
     //printk("hi_ssp_set_frameform, write CR0=%08X\n", ret);
     return 0;
 }
@@ -338,16 +371,123 @@ static size_t hi_ssp_send(struct hi_spi_host *hispi, const void *buf, size_t cou
 }
 
 
+/*
+ * Only between transfers, with the FIFOs empty: the frame size applies
+ * to whatever is queued.
+ */
+static void hi_ssp_set_width(struct hi_spi_host *hispi, unsigned int bits)
+{
+    unsigned int ret;
+    if (hispi->width == bits)
+        return;
+    ssp_readw(SSP_CR0, ret);
+    ret = (ret & 0xFFF0) | (bits - 1);
+    ssp_writew(SSP_CR0, ret);
+    hispi->width = bits;
+}
+
+/*
+ * 16 bit frames, count even. The frame's MSB goes first on the wire, so
+ * the first byte is its upper half.
+ */
+static size_t hi_ssp_recv16(struct hi_spi_host *hispi, void *buf, size_t count)
+{
+    unsigned char *p;
+    unsigned int ret, dummy = 0xFFFF;
+    unsigned long timeout, read_time;    
+    p = (unsigned char*)buf;
+    
+    timeout = jiffies + msecs_to_jiffies(hispi->host.msecs);
+    ssp_writew(SSP_DR, dummy);
+    do {
+        ssp_readw(SSP_SR, ret);
+        if (ret & 0x04) {
+            ssp_readw(SSP_DR, ret);
+            *p++ = (unsigned char)(ret >> 8);
+            *p++ = (unsigned char)ret;
+            count -= 2;
+            if (count)
+                ssp_writew(SSP_DR, dummy);
+            timeout = jiffies + msecs_to_jiffies(hispi->host.msecs);     
+        }
+        read_time = jiffies;
+    } while (time_before(read_time, timeout) && count);
+    return p - (unsigned char*)buf;
+}
+
+static size_t hi_ssp_send16(struct hi_spi_host *hispi, const void *buf, size_t count)
+{
+    const unsigned char *p;
+    unsigned int ret, recv = count / 2;
+    unsigned long timeout, read_time;    
+    p = (const unsigned char*)buf;
+    
+    timeout = jiffies + msecs_to_jiffies(hispi->host.msecs);
+    do {
+        ssp_readw(SSP_SR, ret);
+        if ((ret & 0x02) && count) {
+            ret = p[0] << 8 | p[1];
+            ssp_writew(SSP_DR, ret);
+            p += 2;
+            count -= 2;
+            timeout = jiffies + msecs_to_jiffies(hispi->host.msecs);
+        } else if(ret & 0x4) {
+            //clear recv fifo
+            ssp_readw(SSP_DR, ret);
+            recv--;
+        }
+        read_time = jiffies;
+    } while (time_before(read_time, timeout) && (count || recv));
+    return p - (const unsigned char*)buf;
+}
+
+/*
+ * Data phases: the even part of long transfers in 16 bit frames, half the
+ * register accesses and FIFO turns, an odd last byte in an 8 bit frame.
+ * Commands and addresses keep using hi_ssp_send.
+ */
+static size_t hi_ssp_recv_data(struct hi_spi_host *hispi, void *buf, size_t count)
+{
+    size_t xmit = 0, even = count & ~1;
+    if (count >= SSP_WIDE_MIN) {
+        hi_ssp_set_width(hispi, 16);
+        xmit = hi_ssp_recv16(hispi, buf, even);
+        hi_ssp_set_width(hispi, 8);
+        if (xmit != even)
+            return xmit;
+    }
+    if (xmit < count)
+        xmit += hi_ssp_recv(hispi, (unsigned char*)buf + xmit, count - xmit);
+    return xmit;
+}
+
+static size_t hi_ssp_send_data(struct hi_spi_host *hispi, const void *buf, size_t count)
+{
+    size_t xmit = 0, even = count & ~1;
+    if (count >= SSP_WIDE_MIN) {
+        hi_ssp_set_width(hispi, 16);
+        xmit = hi_ssp_send16(hispi, buf, even);
+        hi_ssp_set_width(hispi, 8);
+        if (xmit != even)
+            return xmit;
+    }
+    if (xmit < count)
+        xmit += hi_ssp_send(hispi, (const unsigned char*)buf + xmit, count - xmit);
+    return xmit;
+}
+
 static int hi_ssp_init_defcfg(struct hi_spi_host *hispi)
 {
     unsigned char spo = 1;
     unsigned char sph = 1;
     unsigned char scr = 1;
     unsigned char cpsdvsr = SSP_CPSDVR;
-    printk("hi_ssp_init_defcfg...\n");
+    printk(KERN_DEBUG "hi_ssp_init_defcfg...\n");
     hi_ssp_disable(hispi);
     hi_ssp_set_frameform(hispi, 0, spo, sph, 8);    
     hi_ssp_set_serialclock(hispi, scr, cpsdvsr);    
+    hispi->reqhz = 0;
+    hispi->hz = ssp_clk / (cpsdvsr * (scr + 1));
     // altasens mode
     hi_ssp_alt_mode_set(hispi, 1);
     //close interupt
@@ -360,25 +500,63 @@ static int hi_ssp_init_defcfg(struct hi_spi_host *hispi)
 
 static int hi_ssp_select_bus(struct spi_hostdev *spi, unsigned int cs)
 {
+    if (cs >= spi->csnums)
+        return -EINVAL;
+    spi->cs = cs;
     return 0;
 }
 
+static void hi_ssp_stream_stop(struct spi_hostdev *spi)
+{
+    struct hi_spi_host *hispi = container_of(spi, struct hi_spi_host, host);
+    if (spi->streaming) {
+        hi_ssp_cs(hispi, 1);
+        spi->streaming = 0;
+    }
+}
+
+static int hi_ssp_stream_read(struct spi_hostdev *spi, const void *cmd, size_t len, void *buf, size_t recv)
+{
+    size_t xmit;
+    struct hi_spi_host *hispi = container_of(spi, struct hi_spi_host, host);
+    
+    if (cmd) {
+        hi_ssp_stream_stop(spi);
+        hi_ssp_wait_buf_fifo_ok(hispi);
+        hi_ssp_cs(hispi, 0);
+        spi->streaming = 1;
+        if (hi_ssp_send(hispi, cmd, len) != len) {
+            hi_ssp_stream_stop(spi);
+            return -ETIMEDOUT;
+        }
+    } else if (!spi->streaming) {
+        return -EPIPE;
+    }
+    if (recv == 0)
+        return 0;
+    xmit = hi_ssp_recv_data(hispi, buf, recv);
+    if (xmit != recv)
+        hi_ssp_stream_stop(spi);
+    return xmit;
+}
+
 static int hi_ssp_transmit(struct spi_hostdev *spi, const void *cmd, size_t len, void *buf, size_t send, size_t recv)
 {
     //unsigned long start = jiffies;
     size_t xmit;
     struct hi_spi_host *hispi = container_of(spi, struct hi_spi_host, host);
     
+    hi_ssp_stream_stop(spi);
     hi_ssp_wait_buf_fifo_ok(hispi);
     hi_ssp_cs(hispi, 0);
     xmit = hi_ssp_send(hispi, cmd, len);
     //printk("hi_ssp_transmit, sent0: %02X, %d\n", ((char*)cmd)[0], xmit);
     if (xmit == len) {
         if (send) {
-            xmit = hi_ssp_send(hispi, buf, send);
+            xmit = hi_ssp_send_data(hispi, buf, send);
             //printk("hi_ssp_transmit, sent1: %d, %ld\n", xmit, jiffies-start);
         } else if (recv) {
-            xmit = hi_ssp_recv(hispi, buf, recv);
+            xmit = hi_ssp_recv_data(hispi, buf, recv);
             //printk("hi_ssp_transmit, recv: %d, %ld\n", xmit, jiffies-start);
         }
     } else {
@@ -388,9 +566,72 @@ static int hi_ssp_transmit(struct spi_hostdev *spi, const void *cmd, size_t len,
     return xmit;
 }
 
+/*
+ * The FIFO is synced once for the whole batch, each segment is drained
+ * by hi_ssp_send_data/hi_ssp_recv_data before the next one starts, so CS can be
+ * released right after it.
+ */
+static int hi_ssp_transmit_batch(struct spi_hostdev *spi, const struct spi_segment *segs, unsigned int nsegs)
+{
+    unsigned int i, selected = 0;
+    size_t xmit;
+    int ret = 0;
+    struct hi_spi_host *hispi = container_of(spi, struct hi_spi_host, host);
+
+    hi_ssp_stream_stop(spi);
+    hi_ssp_wait_buf_fifo_ok(hispi);
+    for (i=0; i<nsegs; i++) {
+        if (!selected) {
+            hi_ssp_cs(hispi, 0);
+            selected = 1;
+        }
+        if (segs[i].tx)
+            xmit = hi_ssp_send_data(hispi, segs[i].tx, segs[i].len);
+        else
+            xmit = hi_ssp_recv_data(hispi, segs[i].rx, segs[i].len);
+        if (xmit != segs[i].len) {
+            ret = -ETIMEDOUT;
+            break;
+        }
+        if (segs[i].cs_change) {
+            hi_ssp_cs(hispi, 1);
+            selected = 0;
+        }
+    }
+    if (selected)
+        hi_ssp_cs(hispi, 1);
+    return ret;
+}
+
+/*
+ * SSPCLKOUT = ssp_clk / (CPSDVSR * (1 + SCR)), pick the fastest rate not
+ * above Hz. The smallest prescaler gives the finest steps.
+ *
+ * @return value: the clock set in Hz, negative on error.
+ */
 static int hi_ssp_set_clock(struct spi_hostdev *spi, unsigned int Hz)
 {
-    return 0;
+    unsigned int div, cpsdvsr, scr;
+    struct hi_spi_host *hispi = container_of(spi, struct hi_spi_host, host);
+    if (Hz == 0)
+        return -EINVAL;
+    if (Hz == hispi->reqhz)
+        return hispi->hz;
+    div = DIV_ROUND_UP(ssp_clk, Hz);
+    for (cpsdvsr=2; cpsdvsr<254; cpsdvsr+=2) {
+        if (DIV_ROUND_UP(div, cpsdvsr) <= 256)
+            break;
+    }
+    scr = DIV_ROUND_UP(div, cpsdvsr);
+    if (scr > 256)
+        scr = 256;
+    else if (scr == 0)
+        scr = 1;
+    hi_ssp_wait_buf_fifo_ok(hispi);
+    hi_ssp_set_serialclock(hispi, scr - 1, cpsdvsr);
+    hispi->reqhz = Hz;
+    hispi->hz = ssp_clk / (cpsdvsr * scr);
+    return hispi->hz;
 }
 
 static int hi_ssp_set_mode(struct spi_hostdev *spi, int spo, int sph)
@@ -400,6 +641,42 @@ static int hi_ssp_set_mode(struct spi_hostdev *spi, int spo, int sph)
     return 0;
 }
 
+/*
+ * Status registers repeat for as long as CS stays low, so one opcode is
+ * followed by FIFO sized bursts of dummy bytes, the last byte of a burst
+ * being the newest status.
+ *
+ * @return value: the status with mask cleared, -ETIMEDOUT otherwise.
+ */
+static int hi_ssp_poll_status(struct spi_hostdev *spi, unsigned char cmd, unsigned char mask, int msecs)
+{
+    unsigned int i, ret, status = mask;
+    unsigned long timeout;
+    struct hi_spi_host *hispi = container_of(spi, struct hi_spi_host, host);
+
+    hi_ssp_stream_stop(spi);
+    hi_ssp_wait_buf_fifo_ok(hispi);
+    timeout = jiffies + msecs_to_jiffies(msecs) + 1;
+    hi_ssp_cs(hispi, 0);
+    if (hi_ssp_send(hispi, &cmd, 1) != 1) {
+        hi_ssp_cs(hispi, 1);
+        return -ETIMEDOUT;
+    }
+    do {
+        for (i=0; i<SSP_FIFO_DEPTH; i++)
+            ssp_writew(SSP_DR, 0xFF);
+        for (i=0; i<SSP_FIFO_DEPTH && time_before(jiffies, timeout);) {
+            ssp_readw(SSP_SR, ret);
+            if (ret & 0x04) {
+                ssp_readw(SSP_DR, status);
+                i++;
+            }
+        }
+    } while ((status & mask) && time_before(jiffies, timeout));
+    hi_ssp_cs(hispi, 1);
+    return (status & mask) ? -ETIMEDOUT : (int)(status & 0xFF);
+}
+
 static int hi_ssp_wait_ready(struct spi_hostdev *spi, int msecs)
 {
     unsigned int ret;
@@ -429,7 +706,7 @@ static int hi_ssp_wait_ready(struct spi_hostdev *spi, int msecs)
 static int ssp_io_config(void)
 {
     void __iomem *reg_base_va = ioremap_nocache(MUXCTRL_BASE, MUXCTRL_SIZE);
-    printk("ssp_io_config...\n");
+    printk(KERN_DEBUG "ssp_io_config...\n");
     if (reg_base_va) {
         HI_REG_WRITE(SPI_CLK, 0x01);
         HI_REG_WRITE(SPI_SDO, 0x01);
@@ -447,62 +724,117 @@ static int ssp_io_config(void)
     }
 }
 
-int spi_host_init(unsigned int msecs)
+static void hi_ssp_host_deinit(struct hi_spi_host *hispi)
+{
+    unsigned int i;
+    
+    if (!hispi->reg_ssp_base_va)
+        return;
+    //shun down SPI
+    hi_ssp_stream_stop(&hispi->host);
+    hi_ssp_disable(hispi);
+#ifdef SSP_USE_GPIO_DO_CS
+    for (i=0; i<hispi->host.csnums; i++) {
+        gpio_cs_level(hispi, i, 1);
+        iounmap((void*)hispi->reg_gpio_cs_va[i]);
+        hispi->reg_gpio_cs_va[i] = NULL;
+    }
+#endif
+    hispi->host.csnums = 0;
+    //free iomem resource
+    iounmap((void*)hispi->reg_ssp_base_va);
+    hispi->reg_ssp_base_va = NULL;
+}
+
+static int hi_ssp_host_init(struct hi_spi_host *hispi, unsigned int base, unsigned int msecs)
 {
     int ret;
-    struct hi_spi_host *hispi = spihosts;
+#ifdef SSP_USE_GPIO_DO_CS
+    unsigned int i, index = hispi - spihosts;
+#endif
     
-    ret = ssp_io_config();
-    if (ret) 
-        return ret;        
-    hispi->reg_ssp_base_va = ioremap_nocache((unsigned long)SSP_BASE, (unsigned long)SSP_SIZE);
+    hispi->reg_ssp_base_va = ioremap_nocache((unsigned long)base, (unsigned long)SSP_SIZE);
     if (!hispi->reg_ssp_base_va) {
         printk("Kernel: ioremap ssp base failed!\n");
         return -ENOMEM;
     }
+    hispi->host.csnums = 0;
 #ifdef SSP_USE_GPIO_DO_CS
-    hispi->reg_gpio_cs_va = ioremap_nocache((unsigned long)GPIO_CS_BASE, (unsigned long)GPIO_CS_SIZE);
-    if (!hispi->reg_gpio_cs_va) {
-        printk("Kernel: ioremap gpio base failed!\n");
-        iounmap((void*)hispi->reg_ssp_base_va);
-        return -ENOMEM;
+    //the chip selects of this controller, in cs_gpio order
+    for (i=0; i<cs_nums && hispi->host.csnums<SSP_CS_MAX; i++) {
+        unsigned int cs = hispi->host.csnums;
+        if (cs_ssp[i] != index)
+            continue;
+        hispi->reg_gpio_cs_va[cs] = ioremap_nocache((unsigned long)GPIO_GROUP_BASE(cs_gpio[i]), 
+                                                    (unsigned long)GPIO_SIZE);
+        if (!hispi->reg_gpio_cs_va[cs]) {
+            printk("Kernel: ioremap gpio base failed!\n");
+            hi_ssp_host_deinit(hispi);
+            return -ENOMEM;
+        }
+        hispi->cs_gpio[cs] = cs_gpio[i];
+        gpio_cs_level(hispi, cs, 1);
+        gpio_cs_init(hispi, cs);
+        hispi->host.csnums++;
     }
-    gpio_cs_level(hispi, 1);
-    gpio_cs_init(hispi);
+#else
+    hispi->host.csnums = 1;
 #endif
+    if (hispi->host.csnums == 0) {
+        hi_ssp_host_deinit(hispi);
+        return -ENODEV;
+    }
+    mutex_init(&hispi->host.lock);
     hispi->host.msecs = msecs;
     hispi->host.iftype = SPI_IF_STD;
-    hispi->host.csnums = 1;
+    hispi->host.cs = -1;//none selected yet
     ret = hi_ssp_init_defcfg(hispi);
     if (ret) {
         printk("Kernel: init ssp base failed: %d!\n", ret);
+        hi_ssp_host_deinit(hispi);
         return ret;        
     }
     //map functions
     hispi->host.select_bus = hi_ssp_select_bus;
     hispi->host.transmit = hi_ssp_transmit;
+    hispi->host.transmit_batch = hi_ssp_transmit_batch;
+    hispi->host.stream_read = hi_ssp_stream_read;
+    hispi->host.stream_stop = hi_ssp_stream_stop;
     hispi->host.set_clock = hi_ssp_set_clock;
     hispi->host.set_mode = hi_ssp_set_mode;
     hispi->host.wait_ready = hi_ssp_wait_ready;
+    hispi->host.poll_status = hi_ssp_poll_status;
     hispi->host.entry_4addr = NULL;
     hispi->host.qe_enable = NULL;
     //register spi host to bus
-    ret = spi_host_register(&hispi->host);
-    return ret;
+    return spi_host_register(&hispi->host);
 }
 
-void spi_host_deinit(struct spi_hostdev *spi)
+/*
+ * Every controller is set up and registered on its own, a controller
+ * failing doesn't keep the others from working.
+ */
+int spi_host_init(unsigned int msecs)
 {
-    struct hi_spi_host *hispi = container_of(spi, struct hi_spi_host, host);
+    unsigned int i, found = 0;
+    int ret;
     
-    //shun down SPI
-    hi_ssp_disable(hispi);
-#ifdef SSP_USE_GPIO_DO_CS
-    gpio_cs_level(hispi, 1);
-    iounmap((void*)hispi->reg_gpio_cs_va);
-    hispi->reg_gpio_cs_va = NULL;
-#endif
-    //free iomem resource
-    iounmap((void*)hispi->reg_ssp_base_va);
-    hispi->reg_ssp_base_va = NULL;
-}
\ No newline at end of file
+    ret = ssp_io_config();
+    if (ret) 
+        return ret;        
+    for (i=0; i<ssp_nums; i++) {
+        ret = hi_ssp_host_init(&spihosts[i], ssp_base[i], msecs);
+        if (ret == 0)
+            found++;
+        else
+            printk("Kernel: ssp%u at %08X unusable: %d\n", i, ssp_base[i], ret);
+    }
+    return found ? 0 : ret;
+}
+
+void spi_host_deinit(void)
+{
+    unsigned int i;
+    for (i=0; i<SSP_NUMS; i++)
+        hi_ssp_host_deinit(&spihosts[i]);
+}
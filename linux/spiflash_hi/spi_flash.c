@@ -10,6 +10,7 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/jiffies.h>
 #include <linux/delay.h>
 #include <linux/uaccess.h>
@@ -18,6 +19,10 @@
 #include <linux/miscdevice.h>
 #include <linux/mutex.h>
 #include <linux/log2.h>
+#include <linux/bitops.h>
+#include <linux/crc32.h>
+#include <asm/unaligned.h>
+#include <linux/ktime.h>
 #include "spi_flash.h"
 #include "spi_host.h"
 
@@ -47,22 +52,81 @@ static int write_flash_enable(struct spi_hostdev *spi)
     return 0;
 }
 
+/*
+ * Every flash of a host shares its lock. It is held for a whole driver
+ * call and dropped only while a chip is busy programming or erasing, so
+ * the other chips of the host go on meanwhile. Taking the bus for another
+ * chip ends the stream left open by the previous one.
+ */
+static void lock_bus(struct spi_hostdev *spi, unsigned int cs)
+{
+    mutex_lock(&spi->lock);
+    if (spi->cs != cs) {
+        if (spi->streaming && spi->stream_stop)
+            spi->stream_stop(spi);
+        spi->select_bus(spi, cs);
+    }
+}
+
+static void unlock_bus(struct spi_hostdev *spi)
+{
+    mutex_unlock(&spi->lock);
+}
+
+static void set_oper_clock(struct flash_info *flash, unsigned int type)
+{
+    unsigned int freq = flash->opers[type].freq;
+    if (freq > flash->maxfreq)
+        freq = flash->maxfreq;
+    flash->spi->set_clock(flash->spi, freq);
+}
+
 static int wait_flash_idle(struct flash_info *flash, unsigned int msecs)
 {
     unsigned long timeout, read_time;
     struct spi_hostdev *spi = flash->spi;
     
+    //status polls are tiny, run them as fast as the board allows
+    spi->set_clock(spi, flash->maxfreq);
+    //holding CS for the whole wait is only fine with nobody else on the bus
+    if (spi->poll_status && spi->csnums == 1) {
+        int ret = spi->poll_status(spi, SPI_CMD_RDSR, SPI_CMD_SR_WIP, msecs);
+        if (ret < 0)
+            return ret;
+        flash->busy = 0;
+        return 0;
+    }
     read_time = jiffies;
     timeout = read_time + msecs_to_jiffies(msecs);
     if (read_time == timeout)
         timeout = read_time + 1;
     do {
-        if ((get_flash_status(spi) & 0x01) == 0)
+        if ((get_flash_status(spi) & 0x01) == 0) {
+            //only cleared once WIP is, a timeout leaves the next caller waiting
+            flash->busy = 0;
             return 0;
+        }
+        if (spi->csnums > 1) {
+            unlock_bus(spi);
+            usleep_range(100, 200);
+            lock_bus(spi, flash->cs);
+            spi->set_clock(spi, flash->maxfreq);
+        }
+        read_time = jiffies;
     }while (time_before(read_time, timeout));
     return -ETIMEDOUT;
 }
 
+/*
+ * Programs and erases are left running when write_page/erase_sector
+ * return, whatever goes to the flash next waits for them here. Scanning
+ * the next page or copying the next user chunk overlaps the busy time.
+ */
+static int settle_flash(struct flash_info *flash)
+{
+    return flash->busy ? wait_flash_idle(flash, flash->busy) : 0;
+}
+
 static size_t prepare_command(struct flash_info *flash, unsigned char *cmd, 
                                 unsigned int address, unsigned int type)
 {    
@@ -83,88 +147,432 @@ static size_t prepare_command(struct flash_info *flash, unsigned char *cmd,
     return type + oper->dummy;
 }
 
+static inline int stream_is_open(struct flash_info *flash, unsigned int address)
+{
+    return flash->spi->streaming && flash->spi->cs == flash->cs && 
+           flash->streamaddr == address;
+}
+
+/*
+ * With streaming on, CS stays asserted after a read and the flash keeps
+ * its address counter, so a read starting where the last one stopped only
+ * clocks out data. Every other transaction ends the stream in the host.
+ */
 static int read_flash(struct flash_info *flash, unsigned int address, char *buf, size_t count)
 {
+    int ret;
     unsigned char cmd[16];
-    size_t cmdlen = prepare_command(flash, cmd, address, OPER_READ);
-    return flash->spi->transmit(flash->spi, cmd, cmdlen, buf, 0, count);
+    size_t cmdlen;
+    struct spi_hostdev *spi = flash->spi;
+    
+    ret = settle_flash(flash);
+    if (ret)
+        return ret;
+    if (!flash->stream || !spi->stream_read) {
+        cmdlen = prepare_command(flash, cmd, address, OPER_READ);
+        set_oper_clock(flash, OPER_READ);
+        return spi->transmit(spi, cmd, cmdlen, buf, 0, count);
+    }
+    if (stream_is_open(flash, address)) {
+        ret = spi->stream_read(spi, NULL, 0, buf, count);
+    } else {
+        cmdlen = prepare_command(flash, cmd, address, OPER_READ);
+        set_oper_clock(flash, OPER_READ);
+        ret = spi->stream_read(spi, cmd, cmdlen, buf, count);
+    }
+    flash->streamaddr = ret > 0 ? address + ret : INFINITE;
+    return ret;
+}
+
+void stop_spiflash_stream(struct flash_info *flash)
+{
+    struct spi_hostdev *spi = flash->spi;
+    mutex_lock(&spi->lock);
+    //the open stream may be another chip's
+    if (spi->streaming && spi->cs == flash->cs && spi->stream_stop)
+        spi->stream_stop(spi);
+    mutex_unlock(&spi->lock);
+    flash->streamaddr = INFINITE;
+}
+
+/*
+ * WREN, the command with its payload and the first status read as one
+ * host batch, returns that status or an error code. Only a busy flash
+ * needs wait_flash_idle afterwards.
+ */
+static int write_enabled(struct flash_info *flash, const unsigned char *cmd, size_t cmdlen, 
+                        const char *buf, size_t count)
+{
+    static const unsigned char wren[1] = {SPI_CMD_WREN};
+    static const unsigned char rdsr[1] = {SPI_CMD_RDSR};
+    unsigned char status;
+    struct spi_segment segs[5];
+    unsigned int n = 0;
+    int ret;
+
+    segs[n].tx = wren;
+    segs[n].len = 1;
+    segs[n++].cs_change = 1;
+    segs[n].tx = cmd;
+    segs[n].len = cmdlen;
+    segs[n++].cs_change = (count == 0);
+    if (count) {
+        segs[n].tx = buf;
+        segs[n].len = count;
+        segs[n++].cs_change = 1;
+    }
+    segs[n].tx = rdsr;
+    segs[n].len = 1;
+    segs[n++].cs_change = 0;
+    segs[n].tx = NULL;
+    segs[n].rx = &status;
+    segs[n].len = 1;
+    segs[n++].cs_change = 1;
+    ret = flash->spi->transmit_batch(flash->spi, segs, n);
+    return ret ? ret : status;
 }
 
 static int write_page(struct flash_info *flash, unsigned int address, char *buf, size_t count)
 {
+    int ret;
     unsigned char cmd[16];
     size_t cmdlen = address & ((flash->pagesize-1));
     if (cmdlen + count > flash->pagesize)
         count = flash->pagesize - cmdlen;
-    for(cmdlen=0; cmdlen<count; cmdlen++) {
-        if (buf[cmdlen] != 0xFF) {
-            int ret;
-            //printk("write_page...\n");
-            write_flash_enable(flash->spi);
-            cmdlen = prepare_command(flash, cmd, address, OPER_WRITE);
-            ret = flash->spi->transmit(flash->spi, cmd, cmdlen, buf, count, 0);
-            wait_flash_idle(flash, flash->opers[OPER_ERASE].msecs);            
-            return ret;
-        }
-    }
+    //nothing to program in a blank page
+    if (!memchr_inv(buf, 0xFF, count))
+        return count;
+    //printk("write_page...\n");
+    cmdlen = prepare_command(flash, cmd, address, OPER_WRITE);
+    ret = settle_flash(flash);
+    if (ret)
+        return ret;
+    set_oper_clock(flash, OPER_WRITE);
+    ret = write_enabled(flash, cmd, cmdlen, buf, count);
+    if (ret < 0)
+        return ret;
+    flash->stats.prog_pages++;
+    flash->stats.prog_bytes += count;
+    if (ret & 0x01)
+        flash->busy = flash->opers[OPER_ERASE].msecs;
     return count;
 }
 
 static int erase_sector(struct flash_info *flash, unsigned int address)
 {
     unsigned char cmd[16];
+    unsigned int sector = address / flash->sectorsize;
     size_t cmdlen = prepare_command(flash, cmd, address & (~(flash->sectorsize-1)), OPER_ERASE);
+    int ret;
     //printk("erase sector...\n");
-    write_flash_enable(flash->spi);
-    flash->spi->transmit(flash->spi, cmd, cmdlen, NULL, 0, 0);
-    wait_flash_idle(flash, flash->opers[OPER_ERASE].msecs);
+    ret = settle_flash(flash);
+    if (ret)
+        return ret;
+    set_oper_clock(flash, OPER_ERASE);
+    ret = write_enabled(flash, cmd, cmdlen, NULL, 0);
+    if (ret < 0)
+        return ret;
+    if (sector < flash->sectornums)
+        flash->erasecnt[sector]++;
+    flash->stats.erase_sectors++;
+    if (ret & 0x01)
+        flash->busy = flash->opers[OPER_ERASE].msecs;
     return 0;
 }
 
-static int write_sector(struct flash_info *flash, unsigned int address, const char *buf, size_t count)
+/*
+ * Sector content index. A CRC32 per sector is recorded whenever a whole
+ * sector passes through the driver: read, cached for writing or written.
+ * A full sector write that matches it is dropped without bus access.
+ * Anything that changes the flash behind write_sector must invalidate.
+ * Sectors past sectornums have no slot and are never indexed.
+ */
+static void index_sector(struct flash_info *flash, unsigned int sector, const unsigned char *data)
 {
+    if (sector >= flash->sectornums)
+        return;
+    flash->sectorcrc[sector] = crc32_le(~0, data, flash->sectorsize);
+    __set_bit(sector, flash->crcvalid);
+}
+
+static void index_range(struct flash_info *flash, unsigned int address, const unsigned char *data, size_t count)
+{
+    unsigned int skip = (flash->sectorsize - (address & (flash->sectorsize-1))) & (flash->sectorsize-1);
+    if (count < skip)
+        return;
+    for (data += skip, address += skip, count -= skip; count >= flash->sectorsize; 
+         data += flash->sectorsize, address += flash->sectorsize, count -= flash->sectorsize) {
+        if (address / flash->sectorsize >= flash->sectornums)
+            break;
+        if (!test_bit(address / flash->sectorsize, flash->crcvalid))
+            index_sector(flash, address / flash->sectorsize, data);
+    }
+}
+
+//mirror of address, which must lie in the shadow window
+static inline unsigned char *shadow_at(struct flash_info *flash, unsigned int address)
+{
+    return flash->shadow + (address - flash->shadowstart);
+}
+
+//also drops the sectors from the shadow
+static void invalidate_index(struct flash_info *flash, unsigned int address, size_t count)
+{
+    unsigned int first = address / flash->sectorsize;
+    unsigned int nums = count / flash->sectorsize;
+    if (first >= flash->sectornums)
+        return;
+    if (nums > flash->sectornums - first)
+        nums = flash->sectornums - first;
+    bitmap_clear(flash->crcvalid, first, nums);
+    if (flash->shadow)
+        bitmap_clear(flash->shadowvalid, first, nums);
+}
+
+static int sector_unchanged(struct flash_info *flash, unsigned int sector, const unsigned char *data)
+{
+    if (sector >= flash->sectornums)
+        return 0;
+    return test_bit(sector, flash->crcvalid) && 
+           flash->sectorcrc[sector] == crc32_le(~0, data, flash->sectorsize);
+}
+
+/*
+ * Result of comparing new data with the cached sector, offsets and pages
+ * are relative to the sector.
+ */
+struct sector_diff {
+    unsigned int differs;
+    unsigned int need_erase;//some bit has to go from 0 to 1
+    unsigned int first;     //first differing byte
+    unsigned int last;      //last differing byte
+    DECLARE_BITMAP(dirty, SECTOR_PAGES_MAX);//pages with differing bytes
+    unsigned short pfirst[SECTOR_PAGES_MAX];//first differing byte of a dirty page
+    unsigned short plast[SECTOR_PAGES_MAX];//last differing byte of a dirty page
+};
+
+/*
+ * One pass over new vs. bufcached at offset. Equal words are skipped a
+ * word at a time, only the bytes of differing words and the unaligned
+ * head and tail are looked at one by one.
+ */
+static unsigned int diff_sector(struct flash_info *flash, unsigned int offset, 
+                    const unsigned char *new, size_t count, struct sector_diff *d)
+{
+    const unsigned char *old = flash->bufcached + offset;
+    unsigned int page, shift = ilog2(flash->pagesize);
+    size_t i = 0;
+
+    d->differs = 0;
+    d->need_erase = 0;
+    bitmap_zero(d->dirty, SECTOR_PAGES_MAX);
+    while (i < count) {
+        if (((unsigned long)(old + i) & (sizeof(long)-1)) == 0 && count - i >= sizeof(long) &&
+            *(const unsigned long *)(old + i) == get_unaligned((const unsigned long *)(new + i))) {
+            i += sizeof(long);
+            continue;
+        }
+        if (old[i] != new[i]) {
+            if (!d->differs)
+                d->first = offset + i;
+            d->last = offset + i;
+            d->differs = 1;
+            d->need_erase |= ~old[i] & new[i];
+            page = (offset + i) >> shift;
+            if (!test_bit(page, d->dirty))
+                d->pfirst[page] = offset + i;
+            d->plast[page] = offset + i;
+            __set_bit(page, d->dirty);
+        }
+        i++;
+    }
+    return d->differs;
+}
+
+/*
+ * Atomic sector updates. The last JOURNAL_SPARES + JOURNAL_SECTORS
+ * sectors leave the user area: a pool of spare sectors and a ring of
+ * journal sectors holding page sized records. Every update is recorded
+ * before its sector is touched:
+ *  - no erase needed and the changed bytes fit a record: they go into
+ *    the record itself, the cost is one extra page program;
+ *  - otherwise the new image is programmed to an erased spare and the
+ *    record only holds its CRC. The spare is picked by the sequence
+ *    number of the record and erased again as soon as the sector is
+ *    written, the erase runs while the caller goes on.
+ * Only the newest valid record can describe an unfinished update. Probe
+ * reads the journal once and redoes it if the target doesn't match. A
+ * journal sector is erased when the ring enters it.
+ *
+ * Wear: each spare takes one erase per JOURNAL_SPARES updates needing an
+ * erase, each journal sector one per JOURNAL_SECTORS * 16 records. At
+ * 100k cycles the pool lasts about 800k erasing updates, whatever
+ * sectors they go to; erase_counts of the last sectors tells how far.
+ */
+#define JOURNAL_MAGIC	0x4A524E4C	//"JRNL"
+#define JOURNAL_SECTORS	2
+#define JOURNAL_SPARES	8
+
+struct journal_rec {
+    u32 magic;
+    u32 seq;
+    u32 address;    //first byte of the payload, or the sector of a spare image
+    u32 len;        //payload bytes after the header, 0 for a spare image
+    u32 crc;        //crc32 of the payload or of the spare image
+    u32 hcrc;       //crc32 of the fields above
+};
+
+//page programs of any span, split at page boundaries
+static int program_range(struct flash_info *flash, unsigned int address, 
+                        const unsigned char *buf, size_t count)
+{
+    size_t len;
     int ret;
-    unsigned int i, addrsector, need_erase = 0;
+    while (count) {
+        len = flash->pagesize - (address & (flash->pagesize-1));
+        if (len > count)
+            len = count;
+        ret = write_page(flash, address, (char *)buf, len);
+        if (ret < 0)
+            return ret;
+        address += len;
+        buf += len;
+        count -= len;
+    }
+    return 0;
+}
+
+//spare holding the image of record seq
+static unsigned int journal_spare(struct flash_info *flash, u32 seq)
+{
+    return flash->spare + (seq % JOURNAL_SPARES) * flash->sectorsize;
+}
+
+static int journal_valid(struct flash_info *flash, const struct journal_rec *rec)
+{
+    if (rec->magic != JOURNAL_MAGIC ||
+        rec->hcrc != crc32_le(~0, (const unsigned char *)rec, offsetof(struct journal_rec, hcrc)))
+        return 0;
+    //a retired journal, nothing to redo
+    if (rec->address == INFINITE)
+        return rec->len == 0;
+    return rec->len <= flash->pagesize - sizeof(*rec) &&
+           rec->address + (rec->len ? rec->len : flash->sectorsize) <= flash->spare &&
+           (rec->len == 0 || rec->crc == crc32_le(~0, (const unsigned char *)(rec + 1), rec->len));
+}
+
+static int journal_append(struct flash_info *flash, struct journal_rec *rec)
+{
+    unsigned int pages = flash->sectorsize / flash->pagesize;
+    int ret;
+    //entering a journal sector, it holds the oldest records
+    if (flash->jslot % pages == 0) {
+        ret = erase_sector(flash, flash->journal + flash->jslot / pages * flash->sectorsize);
+        if (ret)
+            return ret;
+    }
+    rec->magic = JOURNAL_MAGIC;
+    rec->seq = ++flash->jseq;
+    rec->hcrc = crc32_le(~0, (const unsigned char *)rec, offsetof(struct journal_rec, hcrc));
+    ret = write_page(flash, flash->journal + flash->jslot * flash->pagesize, 
+                     (char *)rec, sizeof(*rec) + rec->len);
+    flash->jslot = (flash->jslot + 1) % (JOURNAL_SECTORS * pages);
+    return ret < 0 ? ret : 0;
+}
+
+//record the update of the cached sector, bufcached holds the new content
+static int journal_update(struct flash_info *flash, const struct sector_diff *d)
+{
+    struct journal_rec *rec = (struct journal_rec *)flash->jbuf;
+    unsigned int addrsector = flash->addrcached;
+    unsigned int spare = (flash->jseq + 1) % JOURNAL_SPARES;
+    int ret;
+
+    rec->len = d->last - d->first + 1;
+    if (!d->need_erase && rec->len <= flash->pagesize - sizeof(*rec)) {
+        rec->address = addrsector + d->first;
+        memcpy(rec + 1, &flash->bufcached[d->first], rec->len);
+        rec->crc = crc32_le(~0, (const unsigned char *)(rec + 1), rec->len);
+        return journal_append(flash, rec);
+    }
+    //the record about to be appended gets jseq + 1
+    if (!(flash->spareblank & (1 << spare))) {
+        ret = erase_sector(flash, journal_spare(flash, flash->jseq + 1));
+        if (ret)
+            return ret;
+    }
+    flash->spareblank &= ~(1 << spare);
+    ret = program_range(flash, journal_spare(flash, flash->jseq + 1), 
+                        flash->bufcached, flash->sectorsize);
+    if (ret)
+        return ret;
+    rec->address = addrsector;
+    rec->len = 0;
+    rec->crc = flash->sectorcrc[addrsector / flash->sectorsize];
+    return journal_append(flash, rec);
+}
+
+//the sector is written, get its spare ready for a later image
+static void journal_done(struct flash_info *flash)
+{
+    unsigned int spare = flash->jseq % JOURNAL_SPARES;
+    if (flash->journal != INFINITE && !(flash->spareblank & (1 << spare)) && 
+        erase_sector(flash, journal_spare(flash, flash->jseq)) == 0)
+        flash->spareblank |= 1 << spare;
+}
+
+static int write_sector(struct flash_info *flash, unsigned int address, const char *buf, size_t count)
+{
+    struct sector_diff diff;
+    unsigned int i, start, end, addrsector = flash->addrcached;
+    unsigned int pages = flash->sectorsize / flash->pagesize;
     unsigned int offset = address & ((flash->sectorsize-1));
+    int ret = 0;
     
     //printk("write sector: %08X, %d\n", address, count);
     
     if (count > flash->sectorsize - offset)        
         count = flash->sectorsize - offset; 
-    if (memcmp(&flash->bufcached[offset], buf, count)) {
-        //check if need do erasing
-        addrsector = offset + count;
-        for(i=offset; i<addrsector; i++) {
-            if (flash->bufcached[i] != 0xFF && 
-                flash->bufcached[i] != buf[i-offset]) {
-                printk("write sector need erase...\n");
-                need_erase = 1;
-                break;
-            }
+    if (!diff_sector(flash, offset, buf, count, &diff))
+        return count;
+    memcpy(&flash->bufcached[offset], buf, count);
+    index_sector(flash, addrsector / flash->sectorsize, flash->bufcached);
+    if (flash->shadow && address >= flash->shadowstart && address < flash->shadowend)
+        memcpy(shadow_at(flash, address), buf, count);
+    if (flash->journal != INFINITE)
+        ret = journal_update(flash, &diff);
+    if (ret == 0 && diff.need_erase) {            
+        printk("write sector need erase...\n");
+        ret = erase_sector(flash, addrsector);
+        //the sector is blank now, program each page without its 0xFF edges
+        for (i=0; i<flash->sectorsize && ret >= 0; i += flash->pagesize) {
+            const unsigned char *p = memchr_inv(&flash->bufcached[i], 0xFF, flash->pagesize);
+            if (p == NULL)
+                continue;
+            start = p - flash->bufcached;
+            end = i + flash->pagesize;
+            while (flash->bufcached[end-1] == 0xFF)
+                end--;
+            ret = write_page(flash, addrsector + start, &flash->bufcached[start], end - start);
         }
-        memcpy(&flash->bufcached[offset], buf, count);
-        addrsector = flash->addrcached;
-        if (need_erase) {            
-            erase_sector(flash, addrsector);
-            for (i=addrsector; i<addrsector+flash->sectorsize; i += flash->pagesize) {
-                write_page(flash, i, &flash->bufcached[i-addrsector], flash->pagesize);
-            }
-            ret = count;
-        } else {
-            for (i=address; count;) {
-                unsigned int wlen = flash->pagesize - (i&(flash->pagesize-1));
-                if (count < wlen)
-                    wlen = count;                
-                write_page(flash, i, &flash->bufcached[i-addrsector], wlen);
-                ret += wlen;
-                i += wlen;
-                count -= wlen;
-            }
+    } else if (ret == 0) {
+        //only the changed span of each dirty page
+        for_each_set_bit(i, diff.dirty, pages) {
+            start = diff.pfirst[i];
+            end = diff.plast[i] + 1;
+            ret = write_page(flash, addrsector + start, &flash->bufcached[start], end - start);
+            if (ret < 0)
+                break;
         }
-    } else {
-        ret = count;
     }
-    return ret;
+    if (ret < 0) {
+        //neither cache nor index can be trusted for this sector now
+        flash->addrcached = INFINITE;
+        invalidate_index(flash, addrsector, flash->sectorsize);
+        return ret;
+    }
+    journal_done(flash);
+    return count;
 }
 
 static int inline address_is_cached(struct flash_info *flash, unsigned int address)
@@ -177,71 +585,101 @@ static int inline address_is_cached(struct flash_info *flash, unsigned int addre
 static int wait_buf_idle(struct flash_info *flash, int msecs)
 {
     struct spi_hostdev *spi = flash->spi;
-    int ret = spi->wait_ready(spi, msecs);
-    if (ret == 0)
-        spi->select_bus(spi, flash->cs);
-    return ret;
+    return spi->wait_ready(spi, msecs);
 }
 //=========================================================================================
+static int calibrate_check(struct flash_info *flash, const unsigned char *ref, unsigned char *buf)
+{
+    int i;
+    char cmd[] = {SPI_CMD_RDID};
+    for (i=0; i<2; i++) {
+        if (flash->spi->transmit(flash->spi, cmd, sizeof(cmd), buf, 0, 3) != 3 ||
+            (buf[0]<<16|buf[1]<<8|buf[2]) != flash->id)
+            return -EIO;
+        if (read_flash(flash, 0, buf, flash->pagesize) != flash->pagesize ||
+            memcmp(buf, ref, flash->pagesize))
+            return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Find the fastest clock, up to the fastest opers[].freq, at which the ID 
+ * and the first page read back the same as at SPI_SAFE_FREQ.
+ */
+static void calibrate_spiflash(struct flash_info *flash)
+{
+    struct spi_hostdev *spi = flash->spi;
+    unsigned char *ref = flash->bufcached;
+    unsigned char *buf = flash->bufcached + flash->pagesize;
+    unsigned int i, freq = 0;
+    int hz;
+
+    for (i=0; i<ARRAY_SIZE(flash->opers); i++) {
+        if (flash->opers[i].freq > freq)
+            freq = flash->opers[i].freq;
+    }
+    flash->maxfreq = SPI_SAFE_FREQ;
+    if (read_flash(flash, 0, ref, flash->pagesize) != flash->pagesize)
+        return;
+    while (freq > SPI_SAFE_FREQ) {
+        hz = spi->set_clock(spi, freq);
+        if (hz <= SPI_SAFE_FREQ)
+            break;
+        flash->maxfreq = hz;
+        if (calibrate_check(flash, ref, buf) == 0) {
+            printk("spi flash clock: %d Hz\n", hz);
+            return;
+        }
+        freq = hz - 1; //next slower step of the host
+    }
+    flash->maxfreq = SPI_SAFE_FREQ;
+    printk("spi flash clock: calibration failed, %d Hz\n", SPI_SAFE_FREQ);
+}
+
+static const struct {
+    unsigned int id;
+    char *name;
+    unsigned int sectornums;
+    unsigned int chipsize;
+} jedec_table[] = {
+    {JEDEC_W25Q32BV,  "W25Q32BV",  1024, 4096*1024},
+    {JEDEC_W25Q64FV,  "W25Q64FV",  2048, 4096*2048},
+    {JEDEC_W25Q128FV, "W25Q128FV", 4096, 4096*4096},
+};
+
 struct flash_info* detect_jedec_spiflash(struct spi_hostdev *spi, unsigned int cs)
 {
     int ret;
+    unsigned int i;
     unsigned char buf[3];
     char cmd[] = {SPI_CMD_RDID};
     struct flash_info *flash = NULL;
-    printk("detect_jedec_spiflash...\n");
-    spi->select_bus(spi, cs);
+    printk(KERN_DEBUG "detect_jedec_spiflash...\n");
+    lock_bus(spi, cs);
     ret = spi->transmit(spi, cmd, sizeof(cmd), buf, 0, sizeof(buf));
     if (ret == 3) {
         ret = buf[0]<<16|buf[1]<<8|buf[2];
         printk("found flash: %02X, %02X%02X\n", buf[0],buf[1],buf[2]);
-        if (ret == JEDEC_W25Q32BV) {
-            flash = kzalloc(sizeof(struct flash_info), GFP_KERNEL);
-            if (flash) {
-                flash->spi = spi;
-                flash->cs = cs;
-                flash->name = "W25Q32BV"; 
-                flash->id = ret;
-                flash->pagesize = 256;
-                flash->sectorsize = 4096;
-                flash->sectornums = 1024;
-                flash->chipsize = 4096*1024;
-                flash->addrcycle = 3;
-                flash->addrcached = INFINITE;
-                flash->bufcached = kmalloc(flash->sectorsize, GFP_KERNEL);
-                flash->opers[OPER_READ].cmd = SPI_CMD_FAST_READ;
-                flash->opers[OPER_READ].dummy = 1;
-                flash->opers[OPER_READ].msecs = 0;
-                flash->opers[OPER_READ].freq = 104*1000*1000;
-                
-                flash->opers[OPER_WRITE].cmd = SPI_CMD_PP;
-                flash->opers[OPER_WRITE].dummy = 0;
-                flash->opers[OPER_WRITE].msecs = 3;
-                flash->opers[OPER_WRITE].freq = 104*1000*1000;
-                
-                flash->opers[OPER_ERASE].cmd = SPI_CMD_SE_4K;
-                flash->opers[OPER_ERASE].dummy = 0;
-                flash->opers[OPER_ERASE].msecs = 400;
-                flash->opers[OPER_ERASE].freq = 104*1000*1000;
-                
-                if (flash->bufcached == NULL) {
-                    kfree(flash);
-                    flash = NULL;
-                }
-            }
-        } else if (ret == JEDEC_W25Q64FV) {
+        for (i=0; i<ARRAY_SIZE(jedec_table); i++) {
+            if (jedec_table[i].id == ret)
+                break;
+        }
+        if (i < ARRAY_SIZE(jedec_table)) {
             flash = kzalloc(sizeof(struct flash_info), GFP_KERNEL);
             if (flash) {
                 flash->spi = spi;
                 flash->cs = cs;
-                flash->name = "W25Q64FV"; 
+                flash->name = jedec_table[i].name;
                 flash->id = ret;
                 flash->pagesize = 256;
                 flash->sectorsize = 4096;
-                flash->sectornums = 2048;
-                flash->chipsize = 4096*2049;
+                flash->sectornums = jedec_table[i].sectornums;
+                flash->chipsize = jedec_table[i].chipsize;
                 flash->addrcycle = 3;
                 flash->addrcached = INFINITE;
+                flash->streamaddr = INFINITE;
+                flash->journal = INFINITE;
                 flash->bufcached = kmalloc(flash->sectorsize, GFP_KERNEL);
                 flash->opers[OPER_READ].cmd = SPI_CMD_FAST_READ;
                 flash->opers[OPER_READ].dummy = 1;
@@ -258,40 +696,13 @@ struct flash_info* detect_jedec_spiflash(struct spi_hostdev *spi, unsigned int c
                 flash->opers[OPER_ERASE].msecs = 400;
                 flash->opers[OPER_ERASE].freq = 104*1000*1000;
                 
-                if (flash->bufcached == NULL) {
-                    kfree(flash);
-                    flash = NULL;
+                //the index, erase counts and journal size by sectornums
+                if (flash->chipsize != flash->sectornums * flash->sectorsize) {
+                    printk("spi flash: %s chipsize %u is not %u sectors\n",
+                           flash->name, flash->chipsize, flash->sectornums);
+                    kfree(flash->bufcached);
+                    flash->bufcached = NULL;
                 }
-            }
-        } else if (ret == JEDEC_W25Q128FV) {
-            flash = kzalloc(sizeof(struct flash_info), GFP_KERNEL);
-            if (flash) {
-                flash->spi = spi;
-                flash->cs = cs;
-                flash->name = "W25Q128FV";
-                flash->id = ret;
-                flash->pagesize = 256;
-                flash->sectorsize = 4096;
-                flash->sectornums = 4096;
-                flash->chipsize = 4096*4096;
-                flash->addrcycle = 3;
-                flash->addrcached = INFINITE;
-                flash->bufcached = kmalloc(flash->sectorsize, GFP_KERNEL);
-                flash->opers[OPER_READ].cmd = SPI_CMD_FAST_READ;
-                flash->opers[OPER_READ].dummy = 1;
-                flash->opers[OPER_READ].msecs = 0;
-                flash->opers[OPER_READ].freq = 104*1000*1000;
-                
-                flash->opers[OPER_WRITE].cmd = SPI_CMD_PP;
-                flash->opers[OPER_WRITE].dummy = 0;
-                flash->opers[OPER_WRITE].msecs = 3;
-                flash->opers[OPER_WRITE].freq = 104*1000*1000;
-                
-                flash->opers[OPER_ERASE].cmd = SPI_CMD_SE_4K;
-                flash->opers[OPER_ERASE].dummy = 0;
-                flash->opers[OPER_ERASE].msecs = 400;
-                flash->opers[OPER_ERASE].freq = 104*1000*1000;
-                
                 if (flash->bufcached == NULL) {
                     kfree(flash);
                     flash = NULL;
@@ -299,25 +710,249 @@ struct flash_info* detect_jedec_spiflash(struct spi_hostdev *spi, unsigned int c
             }
         }
     }
+    if (flash) {
+        flash->erasecnt = kcalloc(flash->sectornums, sizeof(unsigned int), GFP_KERNEL);
+        flash->sectorcrc = kcalloc(flash->sectornums, sizeof(u32), GFP_KERNEL);
+        flash->crcvalid = kcalloc(BITS_TO_LONGS(flash->sectornums), sizeof(long), GFP_KERNEL);
+        if (flash->erasecnt == NULL || flash->sectorcrc == NULL || flash->crcvalid == NULL) {
+            kfree(flash->crcvalid);
+            kfree(flash->sectorcrc);
+            kfree(flash->erasecnt);
+            kfree(flash->bufcached);
+            kfree(flash);
+            unlock_bus(spi);
+            return NULL;
+        }
+        //each chip sits on its own wiring, none borrows another's clock
+        calibrate_spiflash(flash);
+    }
+    unlock_bus(spi);
     return flash;
 }
 
 void free_spiflash(struct flash_info* flash)
 {
     if (flash) {
-        struct spi_hostdev *spi = flash->spi;
         if (flash->bufcached)
             kfree(flash->bufcached);
+        if (flash->erasecnt)
+            kfree(flash->erasecnt);
+        vfree(flash->shadow);
+        kfree(flash->shadowvalid);
+        kfree(flash->sectorcrc);
+        kfree(flash->crcvalid);
+        kfree(flash->jbuf);
         kfree(flash);
-        spi_host_deinit(spi);
     }
 }
 
-ssize_t read_spiflash(struct flash_info *flash, 
+/*
+ * Shadow mode: a mirror of [start, start+size) in RAM, the whole chip or
+ * just what must be fast, filled sector by sector with shadow_spiflash
+ * and kept current by write_sector. Reads falling in valid sectors are
+ * served from it without touching the bus.
+ */
+int enable_spiflash_shadow(struct flash_info *flash, unsigned int start, unsigned int size)
+{
+    //shadowvalid has a bit per sector in sectornums
+    unsigned int end = flash->sectornums * flash->sectorsize;
+    if (end > flash->chipsize)
+        end = flash->chipsize;
+    if ((start | size) & (flash->sectorsize-1) || !size ||
+        start > end || size > end - start)
+        return -EINVAL;
+    flash->shadowstart = start;
+    flash->shadowend = start + size;
+    flash->shadow = vmalloc(size);
+    flash->shadowvalid = kcalloc(BITS_TO_LONGS(flash->sectornums), sizeof(long), GFP_KERNEL);
+    if (flash->shadow == NULL || flash->shadowvalid == NULL) {
+        vfree(flash->shadow);
+        kfree(flash->shadowvalid);
+        flash->shadow = NULL;
+        flash->shadowvalid = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Redo the update of the newest journal record unless its target already
+ * holds the recorded content. bufcached serves as scratch, nothing is
+ * cached at probe.
+ */
+static int journal_replay(struct flash_info *flash, const struct journal_rec *rec)
+{
+    unsigned char *buf = flash->bufcached;
+    size_t len = rec->len ? rec->len : flash->sectorsize;
+    int ret;
+
+    if (rec->address == INFINITE)
+        return 0;
+    ret = read_flash(flash, rec->address, buf, len);
+    if (ret != len)
+        return ret < 0 ? ret : -EIO;
+    if (rec->len) {
+        if (memcmp(buf, rec + 1, len) == 0)
+            return 0;
+        printk("spiflash: journal redoes %u bytes at %08X\n", rec->len, rec->address);
+        return program_range(flash, rec->address, (const unsigned char *)(rec + 1), len);
+    }
+    if (crc32_le(~0, buf, len) == rec->crc)
+        return 0;
+    ret = read_flash(flash, journal_spare(flash, rec->seq), buf, len);
+    if (ret != len)
+        return ret < 0 ? ret : -EIO;
+    if (crc32_le(~0, buf, len) != rec->crc) {
+        printk("spiflash: journal spare image for %08X is broken\n", rec->address);
+        return -EIO;
+    }
+    printk("spiflash: journal redoes sector %08X\n", rec->address);
+    ret = erase_sector(flash, rec->address);
+    return ret ? ret : program_range(flash, rec->address, buf, len);
+}
+
+/*
+ * Take the last sectors for the journal and the spares, then finish
+ * whatever update a power loss cut short. Must come before the shadow,
+ * the user area shrinks.
+ */
+static int __enable_spiflash_atomic(struct flash_info *flash)
+{
+    unsigned int i, pages = flash->sectorsize / flash->pagesize;
+    unsigned int slots = JOURNAL_SECTORS * pages, newest = slots;
+    unsigned int used[JOURNAL_SECTORS] = {0};//slots in use of each journal sector
+    unsigned char *buf = flash->bufcached;
+    struct journal_rec *rec;
+    int ret;
+
+    if (flash->shadow || flash->sectornums < 4 * (JOURNAL_SPARES + JOURNAL_SECTORS) || 
+        flash->pagesize < sizeof(*rec) + 16)
+        return -EINVAL;
+    flash->jbuf = kmalloc(flash->pagesize, GFP_KERNEL);
+    if (flash->jbuf == NULL)
+        return -ENOMEM;
+    flash->journal = (flash->sectornums - JOURNAL_SECTORS) * flash->sectorsize;
+    flash->spare = flash->journal - JOURNAL_SPARES * flash->sectorsize;
+    flash->jslot = 0;
+    flash->jseq = 0;
+    flash->spareblank = 0;
+    ret = wait_buf_idle(flash, 50);
+    if (ret)
+        goto fail;
+    for (i=0; i<slots; i++) {
+        if (i % pages == 0) {
+            ret = read_flash(flash, flash->journal + i * flash->pagesize, buf, flash->sectorsize);
+            if (ret != flash->sectorsize)
+                goto fail;
+        }
+        rec = (struct journal_rec *)(buf + (i % pages) * flash->pagesize);
+        if (memchr_inv(rec, 0xFF, flash->pagesize))
+            used[i / pages] = i % pages + 1;
+        if (journal_valid(flash, rec) && (newest == slots || rec->seq > flash->jseq)) {
+            newest = i;
+            flash->jseq = rec->seq;
+            memcpy(flash->jbuf, rec, flash->pagesize);
+        }
+    }
+    //append behind the newest record and whatever got torn after it
+    if (newest < slots)
+        flash->jslot = (newest / pages * pages + used[newest / pages]) % slots;
+    for (i=0; i<JOURNAL_SPARES; i++) {
+        ret = read_flash(flash, flash->spare + i * flash->sectorsize, buf, flash->sectorsize);
+        if (ret != flash->sectorsize)
+            goto fail;
+        if (!memchr_inv(buf, 0xFF, flash->sectorsize))
+            flash->spareblank |= 1 << i;
+    }
+    flash->chipsize = flash->spare;
+    //a failed redo leaves the record in place for the next probe
+    if (newest < slots)
+        journal_replay(flash, (struct journal_rec *)flash->jbuf);
+    printk("spiflash: atomic updates on, journal at %08X, record %u\n", 
+           flash->journal, flash->jseq);
+    return 0;
+fail:
+    kfree(flash->jbuf);
+    flash->jbuf = NULL;
+    flash->journal = INFINITE;
+    return ret < 0 ? ret : -EIO;
+}
+
+int enable_spiflash_atomic(struct flash_info *flash)
+{
+    int ret;
+    lock_bus(flash->spi, flash->cs);
+    ret = __enable_spiflash_atomic(flash);
+    unlock_bus(flash->spi);
+    return ret;
+}
+
+static int shadow_covers(struct flash_info *flash, unsigned int address, size_t count)
+{
+    unsigned int first = address / flash->sectorsize;
+    unsigned int last = (address + count - 1) / flash->sectorsize;
+    return flash->shadow && count && 
+           address >= flash->shadowstart && address + count <= flash->shadowend &&
+           find_next_zero_bit(flash->shadowvalid, last + 1, first) > last;
+}
+
+/*
+ * Read the sectors of [address, address+count) not in the shadow yet,
+ * consecutive ones with a single read. Returns count or an error code.
+ */
+static ssize_t __shadow_spiflash(struct flash_info *flash, unsigned int address, size_t count)
+{
+    unsigned int first = address / flash->sectorsize;
+    unsigned int end = (address + count + flash->sectorsize - 1) / flash->sectorsize;
+    unsigned int next;
+    size_t len;
+    ssize_t ret;
+
+    if (flash->shadow == NULL)
+        return -EINVAL;
+    //only the window is mirrored
+    if (first < flash->shadowstart / flash->sectorsize)
+        first = flash->shadowstart / flash->sectorsize;
+    if (end > flash->shadowend / flash->sectorsize)
+        end = flash->shadowend / flash->sectorsize;
+    while ((first = find_next_zero_bit(flash->shadowvalid, end, first)) < end) {
+        next = find_next_bit(flash->shadowvalid, end, first);
+        address = first * flash->sectorsize;
+        len = (next - first) * flash->sectorsize;
+        ret = settle_flash(flash);
+        if (ret == 0 && !stream_is_open(flash, address))
+            ret = wait_flash_idle(flash, 50);
+        if (ret)
+            return ret;
+        ret = read_flash(flash, address, shadow_at(flash, address), len);
+        if (ret != len)
+            return ret < 0 ? ret : -EIO;
+        flash->stats.read_bytes += len;
+        index_range(flash, address, shadow_at(flash, address), len);
+        bitmap_set(flash->shadowvalid, first, next - first);
+        first = next;
+    }
+    return count;
+}
+
+ssize_t shadow_spiflash(struct flash_info *flash, unsigned int address, size_t count)
+{
+    ssize_t ret;
+    lock_bus(flash->spi, flash->cs);
+    ret = __shadow_spiflash(flash, address, count);
+    unlock_bus(flash->spi);
+    return ret;
+}
+
+static ssize_t __read_spiflash(struct flash_info *flash, 
             char *buf, size_t count, unsigned int address)
 {
     ssize_t readed = 0;
     //char *buf1 = buf;
+    if (shadow_covers(flash, address, count)) {
+        memcpy(buf, shadow_at(flash, address), count);
+        return count;
+    }
     //try to read from cached buffer
     if (address_is_cached(flash, address)) {
         unsigned int offset = address & (flash->sectorsize-1);            
@@ -333,11 +968,17 @@ ssize_t read_spiflash(struct flash_info *flash,
     if (count) {
         ssize_t ret = wait_buf_idle(flash, 50);
         if (ret == 0) {
-            ret = wait_flash_idle(flash, 50);
+            //an open stream proves the flash idle, polling would end it
+            ret = settle_flash(flash);
+            if (ret == 0 && !stream_is_open(flash, address))
+                ret = wait_flash_idle(flash, 50);
             if (ret == 0) {
                 ret = read_flash(flash, address, buf, count);
-                if (ret > 0)
+                if (ret > 0) {
+                    index_range(flash, address, buf, ret);
                     readed += ret;
+                    flash->stats.read_bytes += ret;
+                }
             }
         }
         if (readed == 0)
@@ -354,7 +995,17 @@ ssize_t read_spiflash(struct flash_info *flash,
     return readed;    
 }
 
-ssize_t write_spiflash(struct flash_info *flash, 
+ssize_t read_spiflash(struct flash_info *flash, 
+            char *buf, size_t count, unsigned int address)
+{
+    ssize_t ret;
+    lock_bus(flash->spi, flash->cs);
+    ret = __read_spiflash(flash, buf, count, address);
+    unlock_bus(flash->spi);
+    return ret;
+}
+
+static ssize_t __write_spiflash(struct flash_info *flash, 
             const char *buf, size_t count, unsigned int address)
 {
     unsigned int addrsector;
@@ -363,6 +1014,16 @@ ssize_t write_spiflash(struct flash_info *flash,
         return written;
     
     while (count) {
+        //a full sector matching the index is already there
+        if ((address & (flash->sectorsize-1)) == 0 && count >= flash->sectorsize &&
+            !address_is_cached(flash, address) && 
+            sector_unchanged(flash, address / flash->sectorsize, buf)) {
+            written += flash->sectorsize;
+            buf += flash->sectorsize;
+            address += flash->sectorsize;
+            count -= flash->sectorsize;
+            continue;
+        }
         //first, cache sector;
         if (!address_is_cached(flash, address)) {
             //printk("caching spi flash: %08X\n", address);
@@ -374,6 +1035,10 @@ ssize_t write_spiflash(struct flash_info *flash,
                 break;
             }
             flash->addrcached = addrsector;
+            flash->stats.read_bytes += ret;
+            if (addrsector / flash->sectorsize < flash->sectornums &&
+                !test_bit(addrsector / flash->sectorsize, flash->crcvalid))
+                index_sector(flash, addrsector / flash->sectorsize, flash->bufcached);
         }
         //second, write sector
         addrsector = flash->sectorsize - (address & (flash->sectorsize-1));
@@ -387,5 +1052,293 @@ ssize_t write_spiflash(struct flash_info *flash,
         address += addrsector;
         count -= addrsector;
     }   
+    flash->stats.user_bytes += written;
     return written;
-}
\ No newline at end of file
+}
+
+ssize_t write_spiflash(struct flash_info *flash, 
+            const char *buf, size_t count, unsigned int address)
+{
+    ssize_t ret;
+    lock_bus(flash->spi, flash->cs);
+    ret = __write_spiflash(flash, buf, count, address);
+    unlock_bus(flash->spi);
+    return ret;
+}
+
+/*
+ * Raw access for areas that manage erasing themselves: erase_spiflash
+ * erases whole sectors, program_spiflash programs without reading the
+ * old content, bits already cleared stay cleared. The sector cache is
+ * dropped where it overlaps, index and shadow are invalidated, and a
+ * journal record for the range is retired by a neutral one.
+ */
+static int drop_raw_range(struct flash_info *flash, unsigned int address, size_t count)
+{
+    struct journal_rec *rec = (struct journal_rec *)flash->jbuf;
+    unsigned int first = address & ~(flash->sectorsize-1);
+    unsigned int end = (address + count + flash->sectorsize - 1) & ~(flash->sectorsize-1);
+    if (flash->addrcached >= first && flash->addrcached < end)
+        flash->addrcached = INFINITE;
+    invalidate_index(flash, first, end - first);
+    //the next probe must not redo an older update over the raw data
+    if (flash->journal != INFINITE && flash->jseq && rec->address != INFINITE &&
+        rec->address < end && rec->address + (rec->len ? rec->len : flash->sectorsize) > first) {
+        rec->address = INFINITE;
+        rec->len = 0;
+        rec->crc = 0;
+        return journal_append(flash, rec);
+    }
+    return 0;
+}
+
+static int __erase_spiflash(struct flash_info *flash, unsigned int address, size_t count)
+{
+    int ret;
+    if ((address | count) & (flash->sectorsize-1) || address + count > flash->chipsize)
+        return -EINVAL;
+    ret = wait_buf_idle(flash, 50);
+    if (ret)
+        return ret;
+    ret = drop_raw_range(flash, address, count);
+    if (ret)
+        return ret;
+    for (; count; address += flash->sectorsize, count -= flash->sectorsize) {
+        ret = erase_sector(flash, address);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+static ssize_t __program_spiflash(struct flash_info *flash, 
+            const char *buf, size_t count, unsigned int address)
+{
+    int ret;
+    if (address + count > flash->chipsize)
+        return -EINVAL;
+    ret = wait_buf_idle(flash, 50);
+    if (ret)
+        return ret;
+    ret = drop_raw_range(flash, address, count);
+    if (ret)
+        return ret;
+    ret = program_range(flash, address, (const unsigned char *)buf, count);
+    if (ret)
+        return ret;
+    flash->stats.user_bytes += count;
+    return count;
+}
+
+int erase_spiflash(struct flash_info *flash, unsigned int address, size_t count)
+{
+    int ret;
+    lock_bus(flash->spi, flash->cs);
+    ret = __erase_spiflash(flash, address, count);
+    unlock_bus(flash->spi);
+    return ret;
+}
+
+ssize_t program_spiflash(struct flash_info *flash, 
+            const char *buf, size_t count, unsigned int address)
+{
+    ssize_t ret;
+    lock_bus(flash->spi, flash->cs);
+    ret = __program_spiflash(flash, buf, count, address);
+    unlock_bus(flash->spi);
+    return ret;
+}
+
+void get_spiflash_stats(struct flash_info *flash, struct spiflash_stats *stats)
+{
+    *stats = flash->stats;
+    stats->pagesize = flash->pagesize;
+    stats->sectorsize = flash->sectorsize;
+    stats->sectornums = flash->sectornums;
+    stats->chipsize = flash->chipsize;
+}
+
+void reset_spiflash_stats(struct flash_info *flash)
+{
+    memset(&flash->stats, 0, sizeof(flash->stats));
+    memset(flash->erasecnt, 0, flash->sectornums * sizeof(unsigned int));
+}
+//=========================================================================================
+#define BENCH_LOOPS         64
+#define BENCH_ERASE_LOOPS   3
+#define BENCH_ERASE_MSECS   2000
+
+struct bench_time {
+    s64 min;
+    s64 max;
+    s64 sum;
+    unsigned int n;
+};
+
+static void bench_add(struct bench_time *t, ktime_t start)
+{
+    s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    if (t->n == 0 || ns < t->min)
+        t->min = ns;
+    if (ns > t->max)
+        t->max = ns;
+    t->sum += ns;
+    t->n++;
+}
+
+static size_t bench_print(char *report, size_t size, size_t len, 
+                            const char *name, struct bench_time *t)
+{
+    s64 avg = t->n ? div_s64(t->sum, t->n) : 0;
+    size_t n = scnprintf(report + len, size - len, "%-18s %4u %10lld %10lld %10lld\n", 
+                        name, t->n, t->min, avg, t->max);
+    printk("%s", report + len);
+    memset(t, 0, sizeof(*t));
+    return len + n;
+}
+
+static int erase_block(struct flash_info *flash, unsigned int address, 
+                        unsigned char opcode, unsigned int blocksize)
+{
+    unsigned char cmd[16];
+    unsigned int i;
+    size_t cmdlen = prepare_command(flash, cmd, address, OPER_ERASE);
+    cmd[0] = opcode;
+    set_oper_clock(flash, OPER_ERASE);
+    write_flash_enable(flash->spi);
+    flash->spi->transmit(flash->spi, cmd, cmdlen, NULL, 0, 0);
+    for (i=address/flash->sectorsize; i<(address+blocksize)/flash->sectorsize; i++)
+        flash->erasecnt[i]++;
+    invalidate_index(flash, address, blocksize);
+    flash->stats.erase_sectors += blocksize/flash->sectorsize;
+    return wait_flash_idle(flash, BENCH_ERASE_MSECS);
+}
+
+/*
+ * Time every primitive in isolation, the 64K block at address is destroyed.
+ * Host overhead (xfer_overhead), flash timing (erase, page_program) and
+ * the driver path (read_spiflash vs. fast_read) can be told apart this way.
+ */
+static ssize_t __bench_spiflash(struct flash_info *flash, unsigned int address,
+            char *report, size_t size)
+{
+    static const unsigned int readlens[] = {1, 16, 256, 4096, 65536};
+    static const struct {
+        const char *name;
+        unsigned char cmd;
+        unsigned int size;
+    } erases[] = {
+        {"erase_64k", SPI_CMD_SE_64K, _64K},
+        {"erase_32k", SPI_CMD_SE_32K, _32K},
+        {"erase_4k",  SPI_CMD_SE_4K,  _4K},
+    };
+    struct spi_hostdev *spi = flash->spi;
+    struct bench_time t, tx;
+    unsigned char cmd[16], *buf;
+    unsigned int i, j, loops;
+    size_t cmdlen, len;
+    ktime_t start;
+    char name[24];
+    int ret;
+
+    if ((address & (_64K-1)) || address + _64K > flash->chipsize)
+        return -EINVAL;
+    buf = kmalloc(_64K, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    if (wait_buf_idle(flash, 50) || settle_flash(flash) || wait_flash_idle(flash, 50)) {
+        kfree(buf);
+        return -EBUSY;
+    }
+    //a journal record over the block would be redone into it at the next probe
+    ret = drop_raw_range(flash, address, _64K);
+    if (ret) {
+        kfree(buf);
+        return ret;
+    }
+    len = scnprintf(report, size, "%s @%08X, %u Hz, ns\n%-18s %4s %10s %10s %10s\n", 
+                    flash->name, address, flash->maxfreq, "primitive", "n", "min", "avg", "max");
+    memset(&t, 0, sizeof(t));
+    memset(&tx, 0, sizeof(tx));
+    printk("%s", report);
+
+    //transaction without payload: FIFO sync and CS toggle of the host
+    spi->set_clock(spi, flash->maxfreq);
+    for (i=0; i<BENCH_LOOPS; i++) {
+        start = ktime_get();
+        spi->transmit(spi, NULL, 0, NULL, 0, 0);
+        bench_add(&t, start);
+    }
+    len = bench_print(report, size, len, "xfer_overhead", &t);
+    for (i=0; i<BENCH_LOOPS; i++) {
+        start = ktime_get();
+        get_flash_status(spi);
+        bench_add(&t, start);
+    }
+    len = bench_print(report, size, len, "rdsr", &t);
+    for (i=0; i<BENCH_LOOPS; i++) {
+        start = ktime_get();
+        write_flash_enable(spi);
+        bench_add(&t, start);
+        cmd[0] = SPI_CMD_WRDI;
+        spi->transmit(spi, cmd, 1, NULL, 0, 0);
+    }
+    len = bench_print(report, size, len, "wren", &t);
+    for (j=0; j<ARRAY_SIZE(readlens); j++) {
+        loops = readlens[j] > _4K ? BENCH_LOOPS/8 : BENCH_LOOPS;
+        for (i=0; i<loops; i++) {
+            start = ktime_get();
+            read_flash(flash, address, buf, readlens[j]);
+            bench_add(&t, start);
+        }
+        snprintf(name, sizeof(name), "fast_read_%u", readlens[j]);
+        len = bench_print(report, size, len, name, &t);
+    }
+    for (i=0; i<BENCH_LOOPS; i++) {
+        start = ktime_get();
+        __read_spiflash(flash, buf, _4K, address);
+        bench_add(&t, start);
+    }
+    len = bench_print(report, size, len, "read_spiflash_4096", &t);
+
+    for (j=0; j<ARRAY_SIZE(erases); j++) {
+        for (i=0; i<BENCH_ERASE_LOOPS; i++) {
+            start = ktime_get();
+            erase_block(flash, address, erases[j].cmd, erases[j].size);
+            bench_add(&t, start);
+        }
+        len = bench_print(report, size, len, erases[j].name, &t);
+    }
+    //the block is blank now, program distinct pages
+    erase_block(flash, address, SPI_CMD_SE_64K, _64K);
+    memset(buf, 0x5A, flash->pagesize);
+    for (i=0; i<BENCH_LOOPS && (i+1)*flash->pagesize <= _64K; i++) {
+        cmdlen = prepare_command(flash, cmd, address + i*flash->pagesize, OPER_WRITE);
+        set_oper_clock(flash, OPER_WRITE);
+        start = ktime_get();
+        if (write_enabled(flash, cmd, cmdlen, buf, flash->pagesize) & 0x01) {
+            bench_add(&tx, start);
+            wait_flash_idle(flash, flash->opers[OPER_ERASE].msecs);
+        } else {
+            bench_add(&tx, start);
+        }
+        bench_add(&t, start);
+    }
+    flash->stats.prog_pages += tx.n;
+    flash->stats.prog_bytes += tx.n * flash->pagesize;
+    len = bench_print(report, size, len, "page_program_xfer", &tx);
+    len = bench_print(report, size, len, "page_program", &t);
+    invalidate_index(flash, address, _64K);
+    kfree(buf);
+    return len;
+}
+
+ssize_t bench_spiflash(struct flash_info *flash, unsigned int address,
+            char *report, size_t size)
+{
+    ssize_t ret;
+    lock_bus(flash->spi, flash->cs);
+    ret = __bench_spiflash(flash, address, report, size);
+    unlock_bus(flash->spi);
+    return ret;
+}
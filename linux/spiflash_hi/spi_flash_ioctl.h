@@ -0,0 +1,47 @@
+/******************************************************************************
+*    ioctl interface of /dev/dfl1, shared by the driver and user space tools.
+*
+******************************************************************************/
+
+#ifndef SPI_FLASH_IOCTL_H_
+#define SPI_FLASH_IOCTL_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Wear and write amplification counters, cleared at probe or by
+ * SPIFLASH_IOC_RESET_STATS.
+ * user_bytes/prog_bytes is the write amplification of page programming,
+ * (erase_sectors*sectorsize)/user_bytes the one caused by erasing.
+ */
+struct spiflash_stats {
+    __u64 user_bytes;       //bytes passed to write()
+    __u64 prog_bytes;       //bytes sent by page programs
+    __u64 read_bytes;       //bytes read from the flash (cache hits excluded)
+    __u32 prog_pages;       //page programs issued
+    __u32 erase_sectors;    //sector erases issued
+    __u32 pagesize;
+    __u32 sectorsize;
+    __u32 sectornums;
+    __u32 chipsize;
+};
+
+/* a window of the per-sector erase counters */
+struct spiflash_erasecnt {
+    __u32 first;            //first sector
+    __u32 count;            //number of sectors, updated with the copied one
+    __u64 data;             //user pointer to count __u32
+};
+
+#define SPIFLASH_IOC_MAGIC          'F'
+#define SPIFLASH_IOC_GET_STATS      _IOR(SPIFLASH_IOC_MAGIC, 1, struct spiflash_stats)
+#define SPIFLASH_IOC_RESET_STATS    _IO(SPIFLASH_IOC_MAGIC, 2)
+#define SPIFLASH_IOC_GET_ERASECNT   _IOWR(SPIFLASH_IOC_MAGIC, 3, struct spiflash_erasecnt)
+/* write budget of the open file in bytes/s, programmed plus erased; 0 unlimited */
+#define SPIFLASH_IOC_SET_WRITE_RATE _IOW(SPIFLASH_IOC_MAGIC, 4, __u32)
+#define SPIFLASH_IOC_GET_WRITE_RATE _IOR(SPIFLASH_IOC_MAGIC, 5, __u32)
+/* write back the dirty sectors of the write-back partitions */
+#define SPIFLASH_IOC_SYNC           _IO(SPIFLASH_IOC_MAGIC, 6)
+
+#endif /* SPI_FLASH_IOCTL_H_ */
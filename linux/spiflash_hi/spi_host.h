@@ -1,25 +1,48 @@
 #ifndef SPI_HOST_H_
 #define SPI_HOST_H_
 
+#include <linux/mutex.h>
+
 #define SPI_IF_STD			(0x01)
 #define SPI_IF_DUAL		(0x02)
 #define SPI_IF_QUAD		(0x04)
 
+/*
+ * One piece of a transmit_batch, half duplex like transmit: tx is sent
+ * if set, else len bytes are received into rx.
+ */
+struct spi_segment {
+    const void *tx;
+    void *rx;
+    size_t len;
+    unsigned int cs_change;//release CS after this segment
+};
+
 struct spi_hostdev {
+    struct mutex lock;//taken by the flash driver per call, one chip at a time
     unsigned int msecs;
     unsigned int csnums;
+    unsigned int cs;//chip select of the last select_bus
     unsigned int iftype;
+    unsigned int streaming;//CS is held by stream_read
     int (*select_bus)(struct spi_hostdev *spi, unsigned int cs);
     int (*transmit)(struct spi_hostdev *spi, const void *cmd, size_t len, void *buf, size_t send, size_t recv);
-    int (*set_clock)(struct spi_hostdev *spi, unsigned int Hz);
+    //several transactions in one go, 0 or negative on error
+    int (*transmit_batch)(struct spi_hostdev *spi, const struct spi_segment *segs, unsigned int nsegs);
+    //like transmit, but CS stays asserted; cmd NULL goes on clocking the open stream
+    int (*stream_read)(struct spi_hostdev *spi, const void *cmd, size_t len, void *buf, size_t recv);
+    void (*stream_stop)(struct spi_hostdev *spi);
+    int (*set_clock)(struct spi_hostdev *spi, unsigned int Hz);//returns the clock set, <= Hz
     int (*set_mode)(struct spi_hostdev *spi, int spo, int sph);
     int (*wait_ready)(struct spi_hostdev *spi, int msecs);
+    //send cmd once, clock status bytes on the same CS until (status & mask) == 0
+    int (*poll_status)(struct spi_hostdev *spi, unsigned char cmd, unsigned char mask, int msecs);
     int (*entry_4addr)(struct spi_hostdev *spi, int enable);
     int (*qe_enable)(struct spi_hostdev *spi);
 };
 
 int spi_host_init(unsigned int msecs);
-void spi_host_deinit(struct spi_hostdev *spi);
+void spi_host_deinit(void);
 
 int spi_host_register(struct spi_hostdev *spi);
 
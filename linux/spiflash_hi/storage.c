@@ -18,20 +18,47 @@
 #include <linux/miscdevice.h>
 #include <linux/mutex.h>
 #include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include "spi_flash.h"
 #include "spi_host.h"
 
-#define DEV_NAME    "dfl1"
+#define DEV_NAME    "dfl"
 #define MAX_FLASHS  5
 
+/*
+ * One per flash found, in probe order: /dev/dfl1, /dev/dfl2, ... The lock
+ * serializes the users of a device, the bus is shared through the host.
+ */
 struct spiflash_device {
     struct mutex lock;
     struct flash_info *flash;
+    struct miscdevice misc;
+    char name[8];
+    struct dentry *debugfs;
+    struct debugfs_blob_wrapper erasecnt;
+    struct task_struct *shadowtask;//fills the shadow after probe
+    spinlock_t qlock;       //reads and writes
+    struct list_head reads;
+    struct list_head writes;
+    wait_queue_head_t qwait;
+    struct task_struct *worker;//dispatches the queued requests
+    unsigned char *merge;   //MERGE_MAX bytes for merged requests
+    struct spiflash_part *parts;//partitions of the chip, nparts of them
+    unsigned int nparts;
+    char *bench;            //report of the last microbenchmark
+    size_t benchlen;
 };
 
-static struct spiflash_device dev = {
-    .flash      = NULL,
-};
+static struct spiflash_device devs[MAX_FLASHS];
+static DECLARE_COMPLETION(probed);//all hosts probed, devs[] settled
 
 /*
  * Specs often allow 5 msec for a page write, sometimes 20 msec;
@@ -41,103 +68,807 @@ static unsigned int oper_timeout = 50;
 module_param(oper_timeout, uint, S_IRUGO);
 MODULE_PARM_DESC(write_timeout, "Time (in ms) to wait of one operation (default 50)");
 
+/*
+ * Sequential reads continue the last read transaction without resending
+ * the command; the flash stays selected until another operation or close.
+ */
+static unsigned int stream_read = 1;
+module_param(stream_read, uint, S_IRUGO);
+MODULE_PARM_DESC(stream_read, "Keep CS asserted between sequential reads (default 1)");
+
+/*
+ * Keep a copy of the whole chip in RAM. A kernel thread reads it in after
+ * probe, reads of sectors already copied are served by memcpy.
+ */
+static unsigned int shadow = 0;
+module_param(shadow, uint, S_IRUGO);
+MODULE_PARM_DESC(shadow, "Mirror the chip in RAM, filled in the background (default 0)");
+
+/*
+ * Journal every sector update in the last ten sectors of the chip, a
+ * write cut by power loss is finished at the next probe. The chip
+ * appears ten sectors smaller.
+ */
+static unsigned int atomic = 0;
+module_param(atomic, uint, S_IRUGO);
+MODULE_PARM_DESC(atomic, "Power-fail-safe sector updates through a journal (default 0)");
+
 /*-------------------------------------------------------------------------*/
-static int spiflash_open(struct inode *inode, struct file *filp)
+/*
+ * Partitions of /dev/dfl1, each with a node of its own, /dev/dfl1-<name>:
+ *   parts=boot:0:0x40000:ro,config:0x40000:0x10000:wb,log:0x50000:0x30000:log
+ * Offsets and sizes are sector aligned. The policies:
+ *   wt   write-through, like the whole chip node (default)
+ *   ro   read-only, kept in the RAM shadow
+ *   wb   write-back, see spiflash_wb_write
+ *   raw  whole sectors only, erased and programmed without reading back
+ *   log  append-only, see spiflash_log_write
+ */
+#define MAX_PARTS   8
+
+enum {
+    PART_WT,
+    PART_RO,
+    PART_WB,
+    PART_RAW,
+    PART_LOG,
+};
+
+static const char *part_policies[] = {"wt", "ro", "wb", "raw", "log"};
+
+static char *parts = NULL;
+module_param(parts, charp, S_IRUGO);
+MODULE_PARM_DESC(parts, "Partitions of dfl1, name:offset:size[:policy],... (default none)");
+
+static unsigned int wb_delay = 1000;
+module_param(wb_delay, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wb_delay, "Time (in ms) a write-back sector may stay dirty (default 1000)");
+
+struct spiflash_part {
+    struct spiflash_device *pdev;
+    struct miscdevice misc;
+    char name[24];
+    unsigned int offset;
+    unsigned int size;
+    unsigned int policy;
+    unsigned int head;      //log: next append relative to offset, INFINITE unknown
+    unsigned int dirtyaddr; //wb: sector held in dirty, INFINITE none
+    unsigned char *dirty;
+    unsigned long dirtied;  //jiffies dirtyaddr was taken
+};
+
+static struct spiflash_part *spiflash_find_part(struct spiflash_device *pdev, int minor)
+{
+    unsigned int i;
+    for (i=0; i<pdev->nparts; i++) {
+        if (pdev->parts[i].misc.minor == minor)
+            return &pdev->parts[i];
+    }
+    return NULL;
+}
+
+static unsigned int spiflash_parts_policy(struct spiflash_device *pdev, unsigned int policy)
+{
+    unsigned int i, n = 0;
+    for (i=0; i<pdev->nparts; i++)
+        n += pdev->parts[i].policy == policy;
+    return n;
+}
+
+/*
+ * Write-back partitions keep one dirty sector in RAM, writes landing in it
+ * return at once. It goes to the flash when another sector is written, on
+ * close or SPIFLASH_IOC_SYNC, and wb_delay ms after it got dirty at the
+ * latest. Everything below runs with the device lock held.
+ */
+static int spiflash_wb_flush(struct spiflash_part *part)
+{
+    struct flash_info *flash = part->pdev->flash;
+    ssize_t ret;
+
+    if (part->dirtyaddr == INFINITE)
+        return 0;
+    ret = write_spiflash(flash, part->dirty, flash->sectorsize, part->dirtyaddr);
+    //dropped anyway, a retry would fail the same way
+    if (ret != flash->sectorsize)
+        printk("%s: write-back of %08X failed: %d\n", part->name, part->dirtyaddr, (int)ret);
+    part->dirtyaddr = INFINITE;
+    if (ret != flash->sectorsize)
+        return ret < 0 ? ret : -EIO;
+    return 0;
+}
+
+static ssize_t spiflash_wb_write(struct spiflash_part *part, const unsigned char *buf, 
+            size_t count, unsigned int address)
+{
+    struct flash_info *flash = part->pdev->flash;
+    unsigned int sector = address & ~(flash->sectorsize-1);
+    ssize_t ret;
+
+    if (part->dirtyaddr != sector) {
+        ret = spiflash_wb_flush(part);
+        if (ret)
+            return ret;
+        //a whole sector needn't be read first
+        if (count < flash->sectorsize) {
+            ret = read_spiflash(flash, part->dirty, flash->sectorsize, sector);
+            if (ret != flash->sectorsize)
+                return ret < 0 ? ret : -EIO;
+        }
+        part->dirtyaddr = sector;
+        part->dirtied = jiffies;
+    }
+    memcpy(part->dirty + (address - sector), buf, count);
+    return count;
+}
+
+//dirty sectors are newer than what a read got from the flash
+static void spiflash_wb_overlay(struct spiflash_device *pdev, unsigned char *buf, 
+            unsigned int address, size_t count)
+{
+    struct spiflash_part *part;
+    unsigned int i, from, to;
+
+    for (i=0; i<pdev->nparts; i++) {
+        part = &pdev->parts[i];
+        if (part->dirtyaddr == INFINITE)
+            continue;
+        from = max(address, part->dirtyaddr);
+        to = min_t(unsigned int, address + count, part->dirtyaddr + pdev->flash->sectorsize);
+        if (from < to)
+            memcpy(buf + (from - address), part->dirty + (from - part->dirtyaddr), to - from);
+    }
+}
+
+//write back the dirty sectors in [start, end) dirty for age jiffies or more
+static int spiflash_wb_sync(struct spiflash_device *pdev, unsigned int start, 
+            unsigned int end, unsigned long age)
+{
+    struct spiflash_part *part;
+    unsigned int i;
+    int err, ret = 0;
+
+    for (i=0; i<pdev->nparts; i++) {
+        part = &pdev->parts[i];
+        if (part->dirtyaddr == INFINITE || part->dirtyaddr >= end ||
+            part->dirtyaddr + pdev->flash->sectorsize <= start ||
+            time_before(jiffies, part->dirtied + age))
+            continue;
+        err = spiflash_wb_flush(part);
+        if (err && !ret)
+            ret = err;
+    }
+    return ret;
+}
+
+//jiffies until the oldest dirty sector is due, MAX_SCHEDULE_TIMEOUT if none
+static long spiflash_wb_timeout(struct spiflash_device *pdev)
+{
+    long left, timeout = MAX_SCHEDULE_TIMEOUT;
+    unsigned int i;
+
+    for (i=0; i<pdev->nparts; i++) {
+        if (pdev->parts[i].dirtyaddr == INFINITE)
+            continue;
+        left = (long)(pdev->parts[i].dirtied + msecs_to_jiffies(wb_delay) - jiffies);
+        timeout = min(timeout, max(left, 1L));
+    }
+    return timeout;
+}
+
+//raw partitions take whole sectors, erased and programmed as they come
+static ssize_t spiflash_raw_write(struct spiflash_part *part, const unsigned char *buf, 
+            size_t count, unsigned int address)
+{
+    int ret = erase_spiflash(part->pdev->flash, address, count);
+    return ret ? ret : program_spiflash(part->pdev->flash, buf, count, address);
+}
+
+/*
+ * A log keeps the sector after the head's erased. After a reboot the head
+ * is found behind the last data before the first erased sector; trailing
+ * 0xFF bytes of the last record are taken for free space. pdev->merge
+ * serves as scratch, the worker is the only user.
+ */
+static int spiflash_log_scan(struct spiflash_part *part)
+{
+    struct flash_info *flash = part->pdev->flash;
+    unsigned char *buf = part->pdev->merge;
+    unsigned int i, prev = 0, n = part->size / flash->sectorsize;
+    unsigned long *blank;
+    unsigned char *p;
+    ssize_t ret = 0;
+
+    blank = kcalloc(BITS_TO_LONGS(n), sizeof(long), GFP_KERNEL);
+    if (!blank)
+        return -ENOMEM;
+    for (i=0; i<n; i++) {
+        ret = read_spiflash(flash, buf, flash->sectorsize, part->offset + i * flash->sectorsize);
+        if (ret != flash->sectorsize)
+            goto out;
+        if (!memchr_inv(buf, 0xFF, flash->sectorsize))
+            __set_bit(i, blank);
+    }
+    for (i=0; i<n; i++) {
+        prev = (i + n - 1) % n;
+        if (test_bit(i, blank) && !test_bit(prev, blank))
+            break;
+    }
+    ret = 0;
+    part->head = 0;
+    if (i < n) {
+        ret = read_spiflash(flash, buf, flash->sectorsize, part->offset + prev * flash->sectorsize);
+        if (ret != flash->sectorsize)
+            goto out;
+        ret = 0;
+        for (p = buf + flash->sectorsize; p > buf && p[-1] == 0xFF; p--)
+            ;
+        part->head = (prev * flash->sectorsize + (p - buf)) % part->size;
+    } else if (find_first_bit(blank, n) >= n) {
+        //power lost before the erase ahead, the oldest sector is sacrificed
+        printk("%s: no erased sector, log restarts at 0\n", part->name);
+        ret = erase_spiflash(flash, part->offset, flash->sectorsize);
+    }
+out:
+    kfree(blank);
+    if (ret) {
+        part->head = INFINITE;
+        return ret < 0 ? ret : -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Log partitions append at the head whatever the file offset. Entering a
+ * sector erases the next one, the oldest, so the head always has blank
+ * flash in front of it and no write needs a read-modify-write.
+ */
+static ssize_t spiflash_log_write(struct spiflash_part *part, const unsigned char *buf, size_t count)
+{
+    struct flash_info *flash = part->pdev->flash;
+    size_t len, done = 0;
+    ssize_t ret;
+
+    if (part->head == INFINITE) {
+        ret = spiflash_log_scan(part);
+        if (ret)
+            return ret;
+    }
+    while (done < count) {
+        if ((part->head & (flash->sectorsize-1)) == 0) {
+            ret = erase_spiflash(flash, part->offset + 
+                        (part->head + flash->sectorsize) % part->size, flash->sectorsize);
+            if (ret)
+                return done ? done : ret;
+        }
+        len = min_t(size_t, count - done, flash->sectorsize - (part->head & (flash->sectorsize-1)));
+        ret = program_spiflash(flash, buf + done, len, part->offset + part->head);
+        if (ret < 0)
+            return done ? done : ret;
+        done += len;
+        part->head = (part->head + len) % part->size;
+    }
+    return done;
+}
+
+/*-------------------------------------------------------------------------*/
+/*
+ * I/O scheduler. read() and write() queue a request and sleep, the
+ * device's worker dispatches them under the device lock:
+ *  - reads go first, unless the oldest write has waited write_expire ms;
+ *  - queued reads adjacent to or overlapping the first one are served by
+ *    a single flash read;
+ *  - queued writes to the sector of the first one are laid over one image
+ *    of that sector in arrival order and written once. Writes to
+ *    partitions other than write-through go one by one.
+ */
+#define MERGE_MAX   _16K
+
+static unsigned int write_expire = 500;
+module_param(write_expire, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(write_expire, "Time (in ms) reads may hold back a queued write (default 500)");
+
+struct spiflash_req {
+    struct list_head list;
+    struct spiflash_part *part;//NULL through the whole chip node
+    unsigned int address;
+    size_t count;
+    unsigned char *buf;     //kernel buffer of the caller
+    ssize_t ret;
+    u64 cost;               //bytes programmed plus erased on its behalf
+    unsigned long queued;   //jiffies
+    struct completion done;
+};
+
+static ssize_t spiflash_submit(struct spiflash_device *pdev, struct list_head *queue,
+            struct spiflash_part *part, unsigned char *buf, size_t count, 
+            unsigned int address, u64 *cost)
+{
+    struct spiflash_req req;
+
+    req.part = part;
+    req.address = address;
+    req.count = count;
+    req.buf = buf;
+    req.cost = 0;
+    req.queued = jiffies;
+    init_completion(&req.done);
+    spin_lock(&pdev->qlock);
+    list_add_tail(&req.list, queue);
+    spin_unlock(&pdev->qlock);
+    wake_up(&pdev->qwait);
+    wait_for_completion(&req.done);
+    if (cost)
+        *cost = req.cost;
+    return req.ret;
+}
+
+static inline unsigned int spiflash_policy(const struct spiflash_req *req)
+{
+    return req->part ? req->part->policy : PART_WT;
+}
+
+/*
+ * Move the next request and the ones merging with it to batch, returns
+ * nonzero for writes. Called with qlock held.
+ */
+static int spiflash_pick(struct spiflash_device *pdev, struct list_head *batch)
+{
+    struct spiflash_req *first, *req, *tmp;
+    struct list_head *queue = &pdev->reads;
+    unsigned int start, end;
+    int write = 0;
+
+    if (!list_empty(&pdev->writes)) {
+        first = list_first_entry(&pdev->writes, struct spiflash_req, list);
+        if (list_empty(&pdev->reads) || 
+            time_after_eq(jiffies, first->queued + msecs_to_jiffies(write_expire))) {
+            queue = &pdev->writes;
+            write = 1;
+        }
+    }
+    if (list_empty(queue))
+        return 0;
+    first = list_first_entry(queue, struct spiflash_req, list);
+    list_move_tail(&first->list, batch);
+    if (write && spiflash_policy(first) != PART_WT)
+        return write;
+    start = first->address;
+    end = first->address + first->count;
+    if (write)
+        start &= ~(pdev->flash->sectorsize-1);
+    list_for_each_entry_safe(req, tmp, queue, list) {
+        if (write) {
+            //write() never lets a request cross a sector
+            if (spiflash_policy(req) == PART_WT &&
+                (req->address & ~(pdev->flash->sectorsize-1)) == start)
+                list_move_tail(&req->list, batch);
+        } else if (req->address <= end && req->address + req->count >= start &&
+                   max(end, req->address + req->count) - min(start, req->address) <= MERGE_MAX) {
+            start = min(start, req->address);
+            end = max(end, (unsigned int)(req->address + req->count));
+            list_move_tail(&req->list, batch);
+        }
+    }
+    return write;
+}
+
+static void spiflash_do_read(struct spiflash_device *pdev, struct list_head *batch)
+{
+    struct spiflash_req *req = list_first_entry(batch, struct spiflash_req, list);
+    unsigned int start = req->address, end = 0;
+    ssize_t ret;
+
+    if (list_is_singular(batch)) {
+        req->ret = read_spiflash(pdev->flash, req->buf, req->count, req->address);
+        if (req->ret > 0)
+            spiflash_wb_overlay(pdev, req->buf, req->address, req->ret);
+        return;
+    }
+    list_for_each_entry(req, batch, list) {
+        start = min(start, req->address);
+        end = max(end, (unsigned int)(req->address + req->count));
+    }
+    ret = read_spiflash(pdev->flash, pdev->merge, end - start, start);
+    if (ret > 0)
+        spiflash_wb_overlay(pdev, pdev->merge, start, ret);
+    list_for_each_entry(req, batch, list) {
+        if (ret < 0)
+            req->ret = ret;
+        else if (req->address - start >= ret)
+            req->ret = -EIO;
+        else {
+            req->ret = min_t(ssize_t, req->count, ret - (req->address - start));
+            memcpy(req->buf, pdev->merge + (req->address - start), req->ret);
+        }
+    }
+}
+
+//do the requests of batch leave no hole in [start, end)
+static int spiflash_batch_covers(struct list_head *batch, unsigned int start, unsigned int end)
+{
+    struct spiflash_req *req;
+    unsigned int pos = start, moved = 1;
+
+    while (pos < end && moved) {
+        moved = 0;
+        list_for_each_entry(req, batch, list) {
+            if (req->address <= pos && req->address + req->count > pos) {
+                pos = req->address + req->count;
+                moved = 1;
+            }
+        }
+    }
+    return pos >= end;
+}
+
+//what writing costs the flash, an erase weighs a sector
+static u64 spiflash_cost(struct flash_info *flash)
+{
+    return flash->stats.prog_bytes + (u64)flash->stats.erase_sectors * flash->sectorsize;
+}
+
+static void spiflash_write_through(struct spiflash_device *pdev, struct list_head *batch)
+{
+    struct spiflash_req *req = list_first_entry(batch, struct spiflash_req, list);
+    unsigned int start = req->address, end = 0;
+    u64 cost = spiflash_cost(pdev->flash), total = 0;
+    ssize_t ret;
+
+    //the whole chip node may write where a write-back partition is dirty
+    spiflash_wb_sync(pdev, req->address, req->address + req->count, 0);
+    if (list_is_singular(batch)) {
+        req->ret = write_spiflash(pdev->flash, req->buf, req->count, req->address);
+        req->cost = spiflash_cost(pdev->flash) - cost;
+        return;
+    }
+    list_for_each_entry(req, batch, list) {
+        start = min(start, req->address);
+        end = max(end, (unsigned int)(req->address + req->count));
+        total += req->count;
+    }
+    ret = end - start;
+    //holes between the requests keep what the flash holds
+    if (!spiflash_batch_covers(batch, start, end))
+        ret = read_spiflash(pdev->flash, pdev->merge, end - start, start);
+    if (ret == end - start) {
+        list_for_each_entry(req, batch, list)
+            memcpy(pdev->merge + (req->address - start), req->buf, req->count);
+        ret = write_spiflash(pdev->flash, pdev->merge, end - start, start);
+    }
+    //shared by the merged requests in proportion to their size
+    cost = spiflash_cost(pdev->flash) - cost;
+    list_for_each_entry(req, batch, list) {
+        if (ret == end - start)
+            req->ret = req->count;
+        else
+            req->ret = ret < 0 ? ret : -EIO;
+        req->cost = div64_u64(cost * req->count, total);
+    }
+}
+
+static void spiflash_do_write(struct spiflash_device *pdev, struct list_head *batch)
+{
+    struct spiflash_req *req = list_first_entry(batch, struct spiflash_req, list);
+    u64 cost = spiflash_cost(pdev->flash);
+
+    switch (spiflash_policy(req)) {
+    case PART_WB:
+        req->ret = spiflash_wb_write(req->part, req->buf, req->count, req->address);
+        break;
+    case PART_RAW:
+        req->ret = spiflash_raw_write(req->part, req->buf, req->count, req->address);
+        break;
+    case PART_LOG:
+        req->ret = spiflash_log_write(req->part, req->buf, req->count);
+        break;
+    default:
+        spiflash_write_through(pdev, batch);
+        return;
+    }
+    req->cost = spiflash_cost(pdev->flash) - cost;
+}
+
+static void spiflash_complete(struct list_head *batch, ssize_t ret)
 {
-    int err = -EBUSY;    
-    if (unlikely(!dev.flash))
-        return err;
-    filp->private_data = &dev;
+    struct spiflash_req *req, *tmp;
+    list_for_each_entry_safe(req, tmp, batch, list) {
+        list_del(&req->list);
+        if (ret)
+            req->ret = ret;
+        //req lives on the waiter's stack, gone after this
+        complete(&req->done);
+    }
+}
+
+static int spiflash_worker(void *data)
+{
+    struct spiflash_device *pdev = (struct spiflash_device*)data;
+    LIST_HEAD(batch);
+    long timeout;
+    int write;
+
+    while (!kthread_should_stop()) {
+        timeout = spiflash_wb_timeout(pdev);
+        wait_event_interruptible_timeout(pdev->qwait, kthread_should_stop() ||
+                        !list_empty(&pdev->reads) || !list_empty(&pdev->writes), timeout);
+        if (timeout != MAX_SCHEDULE_TIMEOUT) {
+            mutex_lock(&pdev->lock);
+            spiflash_wb_sync(pdev, 0, INFINITE, msecs_to_jiffies(wb_delay));
+            mutex_unlock(&pdev->lock);
+        }
+        spin_lock(&pdev->qlock);
+        write = spiflash_pick(pdev, &batch);
+        spin_unlock(&pdev->qlock);
+        if (list_empty(&batch))
+            continue;
+        mutex_lock(&pdev->lock);
+        if (write)
+            spiflash_do_write(pdev, &batch);
+        else
+            spiflash_do_read(pdev, &batch);
+        mutex_unlock(&pdev->lock);
+        spiflash_complete(&batch, 0);
+        cond_resched();
+    }
+    mutex_lock(&pdev->lock);
+    spiflash_wb_sync(pdev, 0, INFINITE, 0);
+    mutex_unlock(&pdev->lock);
+    spin_lock(&pdev->qlock);
+    list_splice_init(&pdev->reads, &batch);
+    list_splice_init(&pdev->writes, &batch);
+    spin_unlock(&pdev->qlock);
+    spiflash_complete(&batch, -ENODEV);
     return 0;
 }
 
+static int spiflash_queue_init(struct spiflash_device *pdev, const char *name)
+{
+    spin_lock_init(&pdev->qlock);
+    INIT_LIST_HEAD(&pdev->reads);
+    INIT_LIST_HEAD(&pdev->writes);
+    init_waitqueue_head(&pdev->qwait);
+    pdev->merge = kmalloc(MERGE_MAX, GFP_KERNEL);
+    if (!pdev->merge)
+        return -ENOMEM;
+    pdev->worker = kthread_run(spiflash_worker, pdev, "%s-io", name);
+    if (IS_ERR(pdev->worker)) {
+        pdev->worker = NULL;
+        kfree(pdev->merge);
+        pdev->merge = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void spiflash_queue_exit(struct spiflash_device *pdev)
+{
+    if (pdev->worker)
+        kthread_stop(pdev->worker);
+    pdev->worker = NULL;
+    kfree(pdev->merge);
+    pdev->merge = NULL;
+}
+/*-------------------------------------------------------------------------*/
+/*
+ * Write budget of an open file, a token bucket in bytes programmed plus
+ * erased per second. Opened with write_rate, changed by
+ * SPIFLASH_IOC_SET_WRITE_RATE.
+ */
+static unsigned int write_rate = 0;
+module_param(write_rate, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(write_rate, "Default write budget (in bytes/s) of an open file, 0 unlimited (default 0)");
+
+struct spiflash_file {
+    struct spiflash_device *pdev;
+    struct spiflash_part *part;//NULL for the whole chip
+    unsigned int rate;      //bytes/s, 0 unlimited
+    long long tokens;       //negative: debt of the chunks written
+    unsigned long refill;   //jiffies the tokens were last topped up
+};
+
+/*
+ * A chunk is dispatched once the debt of the ones before is paid, the
+ * writer sleeps meanwhile. A quarter second worth of tokens is kept at
+ * most, enough for a sector erased and rewritten.
+ */
+static int spiflash_throttle(struct spiflash_file *pf)
+{
+    long long burst;
+    unsigned long now;
+
+    if (!pf->rate)
+        return 0;
+    burst = max(pf->rate / 4, 2 * pf->pdev->flash->sectorsize);
+    for (;;) {
+        now = jiffies;
+        pf->tokens += div_u64((u64)pf->rate * (now - pf->refill), HZ);
+        pf->refill = now;
+        if (pf->tokens > burst)
+            pf->tokens = burst;
+        if (pf->tokens >= 0)
+            return 0;
+        if (msleep_interruptible(div_u64((u64)-pf->tokens * 1000, pf->rate) + 1))
+            return -EINTR;
+    }
+}
+
+static void spiflash_set_rate(struct spiflash_file *pf, unsigned int rate)
+{
+    pf->rate = rate;
+    pf->tokens = 0;
+    pf->refill = jiffies;
+}
+
+//window of the file on the chip
+static unsigned int spiflash_base(struct spiflash_file *pf)
+{
+    return pf->part ? pf->part->offset : 0;
+}
+
+static unsigned int spiflash_size(struct spiflash_file *pf)
+{
+    return pf->part ? pf->part->size : pf->pdev->flash->chipsize;
+}
+
+/*-------------------------------------------------------------------------*/
+static int spiflash_open(struct inode *inode, struct file *filp)
+{
+    struct spiflash_part *part = NULL;
+    unsigned int i;
+    //probing goes on in the background, wait for its outcome
+    if (wait_for_completion_interruptible(&probed))
+        return -ERESTARTSYS;
+    for (i=0; i<MAX_FLASHS; i++) {
+        if (devs[i].flash && (devs[i].misc.minor == iminor(inode) ||
+                              (part = spiflash_find_part(&devs[i], iminor(inode))))) {
+            struct spiflash_file *pf = kmalloc(sizeof(*pf), GFP_KERNEL);
+            if (!pf)
+                return -ENOMEM;
+            pf->pdev = &devs[i];
+            pf->part = part;
+            spiflash_set_rate(pf, write_rate);
+            filp->private_data = pf;
+            return 0;
+        }
+    }
+    return -ENODEV;
+}
+
 static int spiflash_release(struct inode *inode, struct file *filp)
 {
-    struct spiflash_device *pdev = (struct spiflash_device*)filp->private_data;
-    if (pdev) {
+    struct spiflash_file *pf = (struct spiflash_file*)filp->private_data;
+    if (pf) {
+        mutex_lock(&pf->pdev->lock);
+        if (pf->part)
+            spiflash_wb_sync(pf->pdev, pf->part->offset, pf->part->offset + pf->part->size, 0);
+        stop_spiflash_stream(pf->pdev->flash);
+        mutex_unlock(&pf->pdev->lock);
+        kfree(pf);
         filp->private_data = NULL;
     }
     return 0;
 }
 
+/*
+ * Long reads are cut into READ_SLICE pieces, the device lock is taken for
+ * one at a time so other users of the flash get their turn in between.
+ */
+#define READ_SLICE  _64K
+
 static ssize_t spiflash_read(struct file *filp, char *buf, size_t count, 
             loff_t *offset)
 {
-    ssize_t ret;
+    ssize_t ret = 0, readed = 0;
+    size_t len;
     unsigned char *kbuf;
-    struct spiflash_device *pdev = (struct spiflash_device*)filp->private_data;
+    struct spiflash_file *pf = (struct spiflash_file*)filp->private_data;
+    struct spiflash_device *pdev = pf->pdev;
+    unsigned int base = spiflash_base(pf), size = spiflash_size(pf);
     //printk("read from spi flash: %d, %d\n", (size_t)*offset, count);
     if (unlikely(*offset < 0))
         return -EFAULT;
     if (unlikely(!count))
         return 0;
-    if (*offset >= pdev->flash->chipsize)
+    if (*offset >= size)
         return 0;
-    if (*offset + count > pdev->flash->chipsize)
-        count = pdev->flash->chipsize - *offset;
-
-    kbuf = kmalloc(count, GFP_KERNEL);
-    if (kbuf) {
-        ret = mutex_lock_interruptible(&pdev->lock);
-        if (ret == 0) {
-            ret = read_spiflash(pdev->flash, kbuf, count, *offset);
-            mutex_unlock(&pdev->lock);
-            if (ret > 0) {
-                ret = ret - copy_to_user(buf, kbuf, ret);
-                *offset += ret;
-            }
-        } else{
-            ret = -EINTR;
+    if (*offset + count > size)
+        count = size - *offset;
+
+    kbuf = kmalloc(min_t(size_t, count, READ_SLICE), GFP_KERNEL);
+    if (!kbuf)
+        return -ENOMEM;
+    while (count) {
+        len = min_t(size_t, count, READ_SLICE);
+        ret = spiflash_submit(pdev, &pdev->reads, pf->part, kbuf, len, base + *offset, NULL);
+        if (ret <= 0)
+            break;
+        if (copy_to_user(buf, kbuf, ret)) {
+            ret = -EFAULT;
+            break;
         }
-        kfree(kbuf);
-    } else {
-        ret = -ENOMEM;
+        *offset += ret;
+        readed += ret;
+        buf += ret;
+        count -= ret;
+        if (ret != len)
+            break;
+        cond_resched();
     }
-    return ret;
+    kfree(kbuf);
+    return readed ? readed : ret;
 }
 
+/*
+ * User data is queued a sector at a time. write_spiflash returns with the
+ * last page still programming, the next chunk is copied in the meantime.
+ */
 static ssize_t spiflash_write(struct file *filp, const char *buf, size_t count,
             loff_t *offset)
 {
-    ssize_t ret;
+    ssize_t ret, written = 0;
+    size_t len;
+    u64 cost;
     unsigned char *kbuf;
-    struct spiflash_device *pdev = (struct spiflash_device*)filp->private_data;
+    struct spiflash_file *pf = (struct spiflash_file*)filp->private_data;
+    struct spiflash_device *pdev = pf->pdev;
+    unsigned int base = spiflash_base(pf), size = spiflash_size(pf);
+    unsigned int policy = pf->part ? pf->part->policy : PART_WT;
     //printk("write to spi flash: %d, %d\n", (size_t)*offset, count);
     if (unlikely(*offset < 0))
         return -EFAULT;
     if (unlikely(!count))
         return 0;
-    if (*offset >= pdev->flash->chipsize)
-        return -EFAULT;		   
-    if (*offset + count > pdev->flash->chipsize)
-        count = pdev->flash->chipsize - *offset;
+    if (policy == PART_RO)
+        return -EROFS;
+    //a log takes any amount at its head, the offset plays no part
+    if (policy != PART_LOG) {
+        if (*offset >= size)
+            return -EFAULT;
+        if (*offset + count > size)
+            count = size - *offset;
+        if (policy == PART_RAW && ((*offset | count) & (pdev->flash->sectorsize-1)))
+            return -EINVAL;
+    }
     
-    kbuf = kmalloc(count, GFP_KERNEL);
-    if (kbuf) {
-        if (copy_from_user(kbuf, buf, count) == 0) {
-            ret = mutex_lock_interruptible(&pdev->lock);
-            if (ret == 0) {
-                ret = write_spiflash(pdev->flash, kbuf, count, *offset);
-                if (ret > 0)
-                    *offset += ret;
-                mutex_unlock(&pdev->lock);
-            } else {
-                ret = -EINTR;
-            }
-        } else {
+    kbuf = kmalloc(pdev->flash->sectorsize, GFP_KERNEL);
+    if (!kbuf)
+        return -ENOMEM;
+    while (count) {
+        len = pdev->flash->sectorsize;
+        if (policy != PART_LOG)
+            len -= *offset & (pdev->flash->sectorsize-1);
+        if (len > count)
+            len = count;
+        ret = spiflash_throttle(pf);
+        if (ret)
+            break;
+        if (copy_from_user(kbuf, buf, len)) {
             ret = -EFAULT;
+            break;
         }
-        kfree(kbuf);
-    } else {
-        ret = -ENOMEM;
+        ret = spiflash_submit(pdev, &pdev->writes, pf->part, kbuf, len, base + *offset, &cost);
+        pf->tokens -= cost;
+        if (ret <= 0)
+            break;
+        if (policy != PART_LOG)
+            *offset += ret;
+        written += ret;
+        buf += ret;
+        count -= ret;
+        if (ret != len)
+            break;
+        cond_resched();
     }
-    return ret;
+    kfree(kbuf);
+    return written ? written : ret;
 }
 
 static loff_t spiflash_llseek(struct file *filp, loff_t offset, int whence)
 {
     loff_t new_offset = -EINVAL;
-    struct spiflash_device *pdev = (struct spiflash_device*)filp->private_data;
+    struct spiflash_file *pf = (struct spiflash_file*)filp->private_data;
+    unsigned int size = spiflash_size(pf);
     switch(whence) {
     case 0: //SEEK_SET
         new_offset = offset;
@@ -146,21 +877,73 @@ static loff_t spiflash_llseek(struct file *filp, loff_t offset, int whence)
         new_offset = filp->f_pos + offset;
         break;        
     case 2: //SEEK_END
-        new_offset = pdev->flash->chipsize + offset;
+        new_offset = size + offset;
         break;
     };
     if (new_offset < 0)
         return -EINVAL;
-    if (new_offset < pdev->flash->chipsize)
+    if (new_offset < size)
         filp->f_pos = new_offset;
     else 
-        filp->f_pos = new_offset - pdev->flash->chipsize;
+        filp->f_pos = new_offset - size;
     return new_offset;
 }
 
 static long spiflash_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    return -ENOTTY;
+    long ret = 0;
+    struct spiflash_stats stats;
+    struct spiflash_erasecnt cnt;
+    __u32 rate;
+    struct spiflash_file *pf = (struct spiflash_file*)filp->private_data;
+    struct spiflash_device *pdev = pf->pdev;
+    switch (cmd) {
+    case SPIFLASH_IOC_GET_STATS:
+        if (mutex_lock_interruptible(&pdev->lock))
+            return -EINTR;
+        get_spiflash_stats(pdev->flash, &stats);
+        mutex_unlock(&pdev->lock);
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            ret = -EFAULT;
+        break;
+    case SPIFLASH_IOC_RESET_STATS:
+        if (mutex_lock_interruptible(&pdev->lock))
+            return -EINTR;
+        reset_spiflash_stats(pdev->flash);
+        mutex_unlock(&pdev->lock);
+        break;
+    case SPIFLASH_IOC_GET_ERASECNT:
+        if (copy_from_user(&cnt, (void __user *)arg, sizeof(cnt)))
+            return -EFAULT;
+        if (cnt.first >= pdev->flash->sectornums)
+            return -EINVAL;
+        if (cnt.count > pdev->flash->sectornums - cnt.first)
+            cnt.count = pdev->flash->sectornums - cnt.first;
+        //counters are only incremented, a torn snapshot is harmless
+        if (copy_to_user((void __user *)(unsigned long)cnt.data, 
+                    &pdev->flash->erasecnt[cnt.first], cnt.count * sizeof(unsigned int)) ||
+            copy_to_user((void __user *)arg, &cnt, sizeof(cnt)))
+            ret = -EFAULT;
+        break;
+    case SPIFLASH_IOC_SET_WRITE_RATE:
+        if (get_user(rate, (__u32 __user *)arg))
+            return -EFAULT;
+        spiflash_set_rate(pf, rate);
+        break;
+    case SPIFLASH_IOC_GET_WRITE_RATE:
+        ret = put_user(pf->rate, (__u32 __user *)arg);
+        break;
+    case SPIFLASH_IOC_SYNC:
+        if (mutex_lock_interruptible(&pdev->lock))
+            return -EINTR;
+        ret = spiflash_wb_sync(pdev, 0, INFINITE, 0);
+        mutex_unlock(&pdev->lock);
+        break;
+    default:
+        ret = -ENOTTY;
+        break;
+    }
+    return ret;
 }
 
 static struct file_operations spiflash_fops = {
@@ -173,42 +956,417 @@ static struct file_operations spiflash_fops = {
     .unlocked_ioctl = spiflash_ioctl,
 };
 /*-------------------------------------------------------------------------*/
-static struct miscdevice spiflash_miscdev = {
-    .minor  = MISC_DYNAMIC_MINOR,
-    .name   = DEV_NAME,
-    .fops   = &spiflash_fops,
+static int spiflash_misc_register(struct spiflash_device *pdev)
+{
+    pdev->misc.minor = MISC_DYNAMIC_MINOR;
+    pdev->misc.name = pdev->name;
+    pdev->misc.fops = &spiflash_fops;
+    return misc_register(&pdev->misc);
+}
+/*-------------------------------------------------------------------------*/
+static void spiflash_parts_exit(struct spiflash_device *pdev)
+{
+    unsigned int i;
+    for (i=0; i<pdev->nparts; i++) {
+        if (pdev->parts[i].misc.fops)
+            misc_deregister(&pdev->parts[i].misc);
+        kfree(pdev->parts[i].dirty);
+    }
+    kfree(pdev->parts);
+    pdev->parts = NULL;
+    pdev->nparts = 0;
+}
+
+//one partition of the parts parameter, name:offset:size[:policy]
+static int spiflash_part_parse(struct spiflash_device *pdev, struct spiflash_part *part, 
+            char *entry, const char *devname)
+{
+    struct flash_info *flash = pdev->flash;
+    char *name = strsep(&entry, ":");
+    char *offset = strsep(&entry, ":");
+    char *size = strsep(&entry, ":");
+    const char *policy = entry ? entry : "wt";
+    unsigned int i;
+
+    if (!*name || !size || kstrtouint(offset, 0, &part->offset) || 
+        kstrtouint(size, 0, &part->size))
+        return -EINVAL;
+    for (i=0; i<ARRAY_SIZE(part_policies) && strcmp(policy, part_policies[i]); i++)
+        ;
+    if (i == ARRAY_SIZE(part_policies) || !part->size ||
+        (part->offset | part->size) & (flash->sectorsize-1) ||
+        part->offset > flash->chipsize || part->size > flash->chipsize - part->offset ||
+        (i == PART_LOG && part->size < 2 * flash->sectorsize) ||
+        snprintf(part->name, sizeof(part->name), "%s-%s", devname, name) >= sizeof(part->name))
+        return -EINVAL;
+    for (part->policy = i, i = 0; i < pdev->nparts; i++) {
+        if (part->offset < pdev->parts[i].offset + pdev->parts[i].size &&
+            pdev->parts[i].offset < part->offset + part->size)
+            return -EINVAL;
+    }
+    part->pdev = pdev;
+    part->head = INFINITE;
+    part->dirtyaddr = INFINITE;
+    if (part->policy == PART_WB) {
+        part->dirty = kmalloc(flash->sectorsize, GFP_KERNEL);
+        if (!part->dirty)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Split the chip after the parts parameter and give every partition its
+ * node. Comes after the journal took its sectors.
+ */
+static int spiflash_parts_init(struct spiflash_device *pdev, const char *devname)
+{
+    struct spiflash_part *part;
+    char *spec, *str, *entry;
+    unsigned int i;
+    int ret = 0;
+
+    if (!parts || !*parts)
+        return 0;
+    spec = str = kstrdup(parts, GFP_KERNEL);
+    pdev->parts = kcalloc(MAX_PARTS, sizeof(struct spiflash_part), GFP_KERNEL);
+    if (!spec || !pdev->parts) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    while ((entry = strsep(&str, ",")) != NULL) {
+        if (!*entry)
+            continue;
+        if (pdev->nparts == MAX_PARTS) {
+            printk("%s: more than %d partitions\n", devname, MAX_PARTS);
+            ret = -EINVAL;
+            goto out;
+        }
+        part = &pdev->parts[pdev->nparts];
+        ret = spiflash_part_parse(pdev, part, entry, devname);
+        if (ret) {
+            kfree(part->dirty);
+            printk("%s: bad partition %s\n", devname, entry);
+            goto out;
+        }
+        pdev->nparts++;
+    }
+    for (i=0; i<pdev->nparts; i++) {
+        part = &pdev->parts[i];
+        part->misc.minor = MISC_DYNAMIC_MINOR;
+        part->misc.name = part->name;
+        part->misc.fops = &spiflash_fops;
+        ret = misc_register(&part->misc);
+        if (ret) {
+            part->misc.fops = NULL;
+            goto out;
+        }
+        printk("%s: %08X-%08X %s\n", part->name, part->offset, 
+               part->offset + part->size - 1, part_policies[part->policy]);
+    }
+out:
+    if (ret)
+        spiflash_parts_exit(pdev);
+    kfree(spec);
+    return ret;
+}
+/*-------------------------------------------------------------------------*/
+static int spiflash_stats_show(struct seq_file *s, void *unused)
+{
+    struct spiflash_device *pdev = (struct spiflash_device*)s->private;
+    struct spiflash_stats stats;
+    unsigned int i, maxcnt = 0, journalcnt = 0;
+    
+    mutex_lock(&pdev->lock);
+    get_spiflash_stats(pdev->flash, &stats);
+    for (i=0; i<stats.sectornums; i++) {
+        if (pdev->flash->erasecnt[i] > maxcnt)
+            maxcnt = pdev->flash->erasecnt[i];
+        //the journal and its spares follow the user area
+        if (i * stats.sectorsize >= stats.chipsize && pdev->flash->journal != INFINITE &&
+            pdev->flash->erasecnt[i] > journalcnt)
+            journalcnt = pdev->flash->erasecnt[i];
+    }
+    mutex_unlock(&pdev->lock);
+    seq_printf(s, "user_bytes:    %llu\n", stats.user_bytes);
+    seq_printf(s, "prog_bytes:    %llu\n", stats.prog_bytes);
+    seq_printf(s, "read_bytes:    %llu\n", stats.read_bytes);
+    seq_printf(s, "prog_pages:    %u\n", stats.prog_pages);
+    seq_printf(s, "erase_sectors: %u\n", stats.erase_sectors);
+    seq_printf(s, "erase_max:     %u\n", maxcnt);
+    if (pdev->flash->journal != INFINITE)
+        seq_printf(s, "journal_max:   %u\n", journalcnt);
+    if (stats.user_bytes) {
+        unsigned long long wa;
+        //amplification in 1/100, programmed and erased bytes vs. user bytes
+        wa = div64_u64(stats.prog_bytes * 100, stats.user_bytes);
+        seq_printf(s, "prog_amp:      %llu.%02llu\n", wa / 100, wa % 100);
+        wa = div64_u64((unsigned long long)stats.erase_sectors * stats.sectorsize * 100, stats.user_bytes);
+        seq_printf(s, "erase_amp:     %llu.%02llu\n", wa / 100, wa % 100);
+    }
+    return 0;
+}
+
+static int spiflash_stats_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, spiflash_stats_show, inode->i_private);
+}
+
+static const struct file_operations spiflash_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = spiflash_stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
 };
+
+#define BENCH_REPORT_SIZE   2048
+
+/* echo <64K aligned scratch address> > bench; cat bench */
+static ssize_t spiflash_bench_write(struct file *filp, const char __user *buf, 
+            size_t count, loff_t *offset)
+{
+    struct spiflash_device *pdev = (struct spiflash_device*)filp->private_data;
+    char str[16];
+    unsigned int address;
+    ssize_t ret;
+
+    if (count >= sizeof(str))
+        return -EINVAL;
+    if (copy_from_user(str, buf, count))
+        return -EFAULT;
+    str[count] = 0;
+    if (kstrtouint(strim(str), 0, &address))
+        return -EINVAL;
+    if (mutex_lock_interruptible(&pdev->lock))
+        return -EINTR;
+    if (!pdev->bench)
+        pdev->bench = kmalloc(BENCH_REPORT_SIZE, GFP_KERNEL);
+    if (pdev->bench) {
+        ret = bench_spiflash(pdev->flash, address, pdev->bench, BENCH_REPORT_SIZE);
+        pdev->benchlen = ret > 0 ? ret : 0;
+    } else {
+        ret = -ENOMEM;
+    }
+    mutex_unlock(&pdev->lock);
+    return ret < 0 ? ret : count;
+}
+
+static ssize_t spiflash_bench_read(struct file *filp, char __user *buf, 
+            size_t count, loff_t *offset)
+{
+    struct spiflash_device *pdev = (struct spiflash_device*)filp->private_data;
+    ssize_t ret;
+    if (mutex_lock_interruptible(&pdev->lock))
+        return -EINTR;
+    ret = simple_read_from_buffer(buf, count, offset, pdev->bench, pdev->benchlen);
+    mutex_unlock(&pdev->lock);
+    return ret;
+}
+
+static const struct file_operations spiflash_bench_fops = {
+    .owner   = THIS_MODULE,
+    .open    = simple_open,
+    .read    = spiflash_bench_read,
+    .write   = spiflash_bench_write,
+    .llseek  = default_llseek,
+};
+
+static void spiflash_debugfs_init(struct spiflash_device *pdev)
+{
+    pdev->debugfs = debugfs_create_dir(pdev->name, NULL);
+    if (IS_ERR_OR_NULL(pdev->debugfs)) {
+        pdev->debugfs = NULL;
+        return;
+    }
+    //raw array of unsigned int, one per sector
+    pdev->erasecnt.data = pdev->flash->erasecnt;
+    pdev->erasecnt.size = pdev->flash->sectornums * sizeof(unsigned int);
+    debugfs_create_blob("erase_counts", S_IRUSR, pdev->debugfs, &pdev->erasecnt);
+    debugfs_create_file("stats", S_IRUSR, pdev->debugfs, pdev, &spiflash_stats_fops);
+    debugfs_create_file("bench", S_IRUSR | S_IWUSR, pdev->debugfs, pdev, &spiflash_bench_fops);
+}
+/*-------------------------------------------------------------------------*/
 /*-------------------------------------------------------------------------*/
+#define SHADOW_CHUNK    _64K
+
+/*
+ * The lock is dropped between chunks so user I/O goes on meanwhile,
+ * sectors the user read in the meantime are skipped by shadow_spiflash.
+ */
+static int spiflash_shadow_fill(struct spiflash_device *pdev, unsigned int start, unsigned int end)
+{
+    unsigned int address;
+    ssize_t ret;
+
+    for (address=start; address<end; address+=SHADOW_CHUNK) {
+        if (kthread_should_stop())
+            return -EINTR;
+        mutex_lock(&pdev->lock);
+        ret = shadow_spiflash(pdev->flash, address, min_t(size_t, SHADOW_CHUNK, end - address));
+        mutex_unlock(&pdev->lock);
+        if (ret < 0) {
+            printk("spiflash shadow: read failed at %08X: %d\n", address, (int)ret);
+            return ret;
+        }
+        cond_resched();
+    }
+    return 0;
+}
+
+//without the shadow parameter only the read-only partitions are copied
+static int spiflash_shadow_thread(void *data)
+{
+    struct spiflash_device *pdev = (struct spiflash_device*)data;
+    struct flash_info *flash = pdev->flash;
+    unsigned long start = jiffies;
+    unsigned int i, bytes = 0;
+    int ret = 0;
+
+    if (shadow) {
+        ret = spiflash_shadow_fill(pdev, 0, flash->chipsize);
+        bytes = flash->chipsize;
+    }
+    for (i=0; i<pdev->nparts && !shadow && ret == 0; i++) {
+        if (pdev->parts[i].policy != PART_RO)
+            continue;
+        ret = spiflash_shadow_fill(pdev, pdev->parts[i].offset, 
+                    pdev->parts[i].offset + pdev->parts[i].size);
+        bytes += pdev->parts[i].size;
+    }
+    if (ret == 0)
+        printk("spiflash shadow: %u bytes in %u ms\n", bytes, jiffies_to_msecs(jiffies - start));
+    //kthread_stop() wants the thread around
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+/*
+ * The whole chip with the shadow parameter, else the span of the
+ * read-only partitions.
+ */
+static void spiflash_shadow_init(struct spiflash_device *pdev)
+{
+    unsigned int i, start = 0, end = pdev->flash->chipsize;
+
+    if (!shadow) {
+        start = INFINITE;
+        end = 0;
+        for (i=0; i<pdev->nparts; i++) {
+            if (pdev->parts[i].policy != PART_RO)
+                continue;
+            start = min(start, pdev->parts[i].offset);
+            end = max(end, pdev->parts[i].offset + pdev->parts[i].size);
+        }
+    }
+    if (enable_spiflash_shadow(pdev->flash, start, end - start)) {
+        printk("spiflash shadow: no memory for %u bytes\n", end - start);
+        return;
+    }
+    pdev->shadowtask = kthread_run(spiflash_shadow_thread, pdev, "%s-shadow", pdev->name);
+    if (IS_ERR(pdev->shadowtask))
+        pdev->shadowtask = NULL;
+}
+
+/*
+ * The first flash takes /dev/dfl1 registered at module load, the ones
+ * after it get their node here.
+ */
 static int spiflash_probe(struct spi_hostdev *spi, unsigned cs)
 {
-    if (dev.flash == NULL) {
-        dev.flash = detect_jedec_spiflash(spi, cs);
-        if (dev.flash)
-            misc_register(&spiflash_miscdev);
+    struct spiflash_device *pdev;
+    unsigned int i;
+
+    for (i=0; i<MAX_FLASHS && devs[i].flash; i++)
+        ;
+    if (i == MAX_FLASHS)
+        return -ENOSPC;
+    pdev = &devs[i];
+    pdev->flash = detect_jedec_spiflash(spi, cs);
+    if (pdev->flash == NULL)
+        return -ENODEV;
+    if (spiflash_queue_init(pdev, pdev->name) || 
+        (i && spiflash_misc_register(pdev))) {
+        spiflash_queue_exit(pdev);
+        free_spiflash(pdev->flash);
+        pdev->flash = NULL;
+        return -ENODEV;
     }
-    return dev.flash ? 0 : -1;
+    pdev->flash->stream = stream_read;
+    if (atomic && enable_spiflash_atomic(pdev->flash))
+        printk("%s: atomic updates unavailable\n", pdev->name);
+    if (i == 0 && spiflash_parts_init(pdev, pdev->name))
+        printk("%s: partitions ignored\n", pdev->name);
+    if (shadow || spiflash_parts_policy(pdev, PART_RO))
+        spiflash_shadow_init(pdev);
+    spiflash_debugfs_init(pdev);
+    return 0;
 }
 
 static int spiflash_remove(struct spiflash_device *spidev)
 {
     if (spidev->flash) {
-        misc_deregister(&spiflash_miscdev);
+        spiflash_queue_exit(spidev);
+        if (spidev->shadowtask)
+            kthread_stop(spidev->shadowtask);
+        spidev->shadowtask = NULL;
+        spiflash_parts_exit(spidev);
+        debugfs_remove_recursive(spidev->debugfs);
+        spidev->debugfs = NULL;
+        kfree(spidev->bench);
+        spidev->bench = NULL;
         free_spiflash(spidev->flash);
         spidev->flash = NULL;
     }
     return 0;
 }
 
+/*
+ * Mapping the SSP, configuring it, detecting and calibrating the flashes
+ * all run in a work item, module loading doesn't wait for them. /dev/dfl1
+ * exists right away, open() waits on probed.
+ */
+static void spiflash_probe_work(struct work_struct *work)
+{
+    int ret = spi_host_init(oper_timeout);
+    if (ret)
+        printk("spiflash: host init failed: %d\n", ret);
+    complete_all(&probed);
+}
+static DECLARE_WORK(probe_work, spiflash_probe_work);
+
 static int __init spiflash_init(void)
 {
-    mutex_init(&dev.lock);
-    return spi_host_init(oper_timeout);
+    unsigned int i;
+    int ret;
+    //names go with the slot, the worker and shadow threads take them too
+    for (i=0; i<MAX_FLASHS; i++) {
+        mutex_init(&devs[i].lock);
+        snprintf(devs[i].name, sizeof(devs[i].name), DEV_NAME "%u", i + 1);
+    }
+    ret = spiflash_misc_register(&devs[0]);
+    if (ret)
+        return ret;
+    schedule_work(&probe_work);
+    return 0;
 }
 module_init(spiflash_init);
 
 static void __exit spiflash_exit(void)
 {
-    spiflash_remove(&dev);
+    unsigned int i;
+    flush_work(&probe_work);
+    for (i=0; i<MAX_FLASHS; i++) {
+        if (i == 0 || devs[i].flash)
+            misc_deregister(&devs[i].misc);
+        spiflash_remove(&devs[i]);
+    }
+    spi_host_deinit();
 }
 module_exit(spiflash_exit);
 
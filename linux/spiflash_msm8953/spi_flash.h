@@ -8,6 +8,13 @@
 #ifndef SPI_FLASH_H_
 #define SPI_FLASH_H_
 
+#include <linux/spi/spi.h>
+#include <linux/completion.h>
+#ifdef CONFIG_FLASH_W25_SPI_MEM
+#include <linux/spi/spi-mem.h>
+#endif
+#include "spi_flash_ioctl.h"
+
 /*****************************************************************************/
 
 #define _1K		(0x400)
@@ -33,6 +40,8 @@
 #define _64M		(0x4000000)
 
 #define INFINITE	(0xFFFFFFFF)
+
+#define SPI_SAFE_FREQ	(10*1000*1000)	/* clock every board can run */
 /*****************************************************************************/
 
 #define SPI_IF_READ_STD			(0x01)
@@ -65,6 +74,7 @@
 /*****************************************************************************/
 
 #define SPI_CMD_WREN			0x06	/* Write Enable */
+#define SPI_CMD_WRDI			0x04	/* Write Disable */
 /*****************************************************************************/
 #define SPI_CMD_SE_4K			0x20	/* 4KB sector Erase */
 #define SPI_CMD_SE_32K			0x52	/* 32KB sector Erase */
@@ -123,6 +133,26 @@ struct spi_operation {
     unsigned int	freq;   //clock frequency in Hz
 };
 
+#define FLASH_XFER_CMD		0	//command only
+#define FLASH_XFER_IO		1	//command and payload
+#define FLASH_XFER_DATA		2	//payload only
+#define FLASH_XFER_PROG		3	//WREN, program, first RDSR
+
+#define FLASH_CHUNK_SIZE	_16K	//one queued read of a pipelined read
+#define FLASH_RING_DEPTH	3	//chunks in flight
+
+struct flash_chunk {
+    unsigned char *cmd;//DMA safe, a cache line of cmdbuf
+    unsigned char *buf;//DMA safe, FLASH_CHUNK_SIZE
+    unsigned int address;
+    size_t len;
+    struct spi_transfer xfer[2];
+    struct spi_message msg;
+    struct completion done;
+};
+
+#define SECTOR_PAGES_MAX	64	//pages of a sector tracked in dirty bitmaps
+
 struct flash_info {
     struct spi_device *spi;
     unsigned int cs;
@@ -135,16 +165,63 @@ struct flash_info {
     unsigned int sectornums;
     unsigned int	chipsize;
     unsigned int	addrcycle;
+    unsigned int	maxfreq;//fastest clock passed calibration, caps opers[].freq
+    unsigned int	stream;//keep reads open for sequential access
+    unsigned int	streamaddr;//next address of the open read stream
+    unsigned int	busy;//ms to wait for a program or erase left running, 0 idle
+    unsigned int	buslocked;//the read stream holds the bus lock
+    unsigned char *cmdbuf;//DMA safe command bytes
+    unsigned char *rxbuf;//DMA safe status byte, own cache line
+    struct spi_transfer xfer[9];//preset transfers of msg[]
+    struct spi_message msg[4];//FLASH_XFER_*
+    struct flash_chunk ring[FLASH_RING_DEPTH];//pipelined reads
+#ifdef CONFIG_FLASH_W25_SPI_MEM
+    struct spi_mem *mem;//of the spi-mem probe, NULL when the controller can't run our ops
+    u32 max_speed_hz;//spi->max_speed_hz to restore, 0 if left untouched
+    struct spi_mem_dirmap_desc *rdesc;//direct mapping for reads, or NULL
+    struct spi_mem_op rdop;//read op, template of rdesc
+#endif
     
     struct spi_operation opers[3]; //0-read, 1-write, 2-erase
+
+    unsigned int *erasecnt;//erase count of each sector
+    u32 *sectorcrc;//crc32 of each sector's content, valid if set in crcvalid
+    unsigned long *crcvalid;
+    unsigned char *shadow;//vmalloc'd mirror of [shadowstart, shadowend), NULL when off
+    unsigned int shadowstart;
+    unsigned int shadowend;
+    unsigned long *shadowvalid;//sectors of shadow holding flash content
+    unsigned int journal;//address of the first journal sector, INFINITE when off
+    unsigned int spare;//address of the first spare, sectors staging whole new images
+    unsigned int spareblank;//bit per spare, set while it is erased
+    unsigned int jslot;//next free record (page) of the journal ring
+    unsigned int jseq;//sequence number of the newest record
+    unsigned char *jbuf;//one page, the record being written or replayed
+    struct spiflash_stats stats;
 };
 
 struct flash_info* detect_jedec_spiflash(struct spi_device *spi);
 void free_spiflash(struct flash_info*);
+#ifdef CONFIG_FLASH_W25_SPI_MEM
+void enable_spiflash_mem(struct flash_info *flash, struct spi_mem *mem);
+#endif
 
 ssize_t read_spiflash(struct flash_info *flash, 
             char *buf, size_t count, unsigned int address);
 ssize_t write_spiflash(struct flash_info *flash, 
             const char *buf, size_t count, unsigned int address);
+ssize_t read_spiflash_user(struct flash_info *flash, 
+            char __user *buf, size_t count, unsigned int address);
+void stop_spiflash_stream(struct flash_info *flash);
+int erase_spiflash(struct flash_info *flash, unsigned int address, size_t count);
+ssize_t program_spiflash(struct flash_info *flash, 
+            const char *buf, size_t count, unsigned int address);
+int enable_spiflash_shadow(struct flash_info *flash, unsigned int start, unsigned int size);
+int enable_spiflash_atomic(struct flash_info *flash);
+ssize_t shadow_spiflash(struct flash_info *flash, unsigned int address, size_t count);
+void get_spiflash_stats(struct flash_info *flash, struct spiflash_stats *stats);
+void reset_spiflash_stats(struct flash_info *flash);
+ssize_t bench_spiflash(struct flash_info *flash, unsigned int address,
+            char *report, size_t size);
 /******************************************************************************/
 #endif /* SPI_FLASH */